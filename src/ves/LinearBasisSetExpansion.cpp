@@ -33,16 +33,530 @@
 #include "tools/Keywords.h"
 #include "tools/Grid.h"
 #include "tools/Communicator.h"
+#include "tools/OpenMP.h"
 
 #include "GridProjWeights.h"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VES_EXPANSION_X86_KERNELS
+#include <immintrin.h>
+#endif
+
 namespace PLMD {
 namespace ves {
 
+namespace {
+
+/*
+Kernels for the innermost loops of the expansion, which all run over
+contiguous rows of the coefficient tensor (i.e. along the first dimension).
+On x86 they are compiled for AVX2 and AVX-512 besides the plain version and
+the variant to use is chosen once at runtime from the features of the CPU.
+*/
+struct RowKernels {
+  // sum_i x[i]*a[i]
+  double (*dot)(const double*, const double*, const size_t);
+  // sum_i x[i]*a[i] and sum_i x[i]*b[i] in a single pass over x
+  void (*dot2)(const double*, const double*, const double*, const size_t, double&, double&);
+  // y[i] = s*a[i]
+  void (*scale)(double*, const double*, const double, const size_t);
+  const char* name;
+};
+
+
+double dotScalar(const double* x, const double* a, const size_t n) {
+  double sum = 0.0;
+  for(size_t i=0; i<n; i++) {sum += x[i]*a[i];}
+  return sum;
+}
+
+
+void dot2Scalar(const double* x, const double* a, const double* b, const size_t n, double& sum_a, double& sum_b) {
+  sum_a = 0.0;
+  sum_b = 0.0;
+  for(size_t i=0; i<n; i++) {
+    sum_a += x[i]*a[i];
+    sum_b += x[i]*b[i];
+  }
+}
+
+
+void scaleScalar(double* y, const double* a, const double s, const size_t n) {
+  for(size_t i=0; i<n; i++) {y[i] = s*a[i];}
+}
+
+
+#ifdef VES_EXPANSION_X86_KERNELS
+
+__attribute__((target("avx2,fma")))
+double hsumAVX2(const __m256d v) {
+  double buf[4];
+  _mm256_storeu_pd(buf,v);
+  return (buf[0]+buf[1])+(buf[2]+buf[3]);
+}
+
+
+__attribute__((target("avx2,fma")))
+double dotAVX2(const double* x, const double* a, const size_t n) {
+  __m256d vsum = _mm256_setzero_pd();
+  size_t i=0;
+  for(; i+4<=n; i+=4) {
+    vsum = _mm256_fmadd_pd(_mm256_loadu_pd(x+i),_mm256_loadu_pd(a+i),vsum);
+  }
+  double sum = hsumAVX2(vsum);
+  for(; i<n; i++) {sum += x[i]*a[i];}
+  return sum;
+}
+
+
+__attribute__((target("avx2,fma")))
+void dot2AVX2(const double* x, const double* a, const double* b, const size_t n, double& sum_a, double& sum_b) {
+  __m256d vsum_a = _mm256_setzero_pd();
+  __m256d vsum_b = _mm256_setzero_pd();
+  size_t i=0;
+  for(; i+4<=n; i+=4) {
+    __m256d vx = _mm256_loadu_pd(x+i);
+    vsum_a = _mm256_fmadd_pd(vx,_mm256_loadu_pd(a+i),vsum_a);
+    vsum_b = _mm256_fmadd_pd(vx,_mm256_loadu_pd(b+i),vsum_b);
+  }
+  sum_a = hsumAVX2(vsum_a);
+  sum_b = hsumAVX2(vsum_b);
+  for(; i<n; i++) {
+    sum_a += x[i]*a[i];
+    sum_b += x[i]*b[i];
+  }
+}
+
+
+__attribute__((target("avx2,fma")))
+void scaleAVX2(double* y, const double* a, const double s, const size_t n) {
+  __m256d vs = _mm256_set1_pd(s);
+  size_t i=0;
+  for(; i+4<=n; i+=4) {
+    _mm256_storeu_pd(y+i,_mm256_mul_pd(vs,_mm256_loadu_pd(a+i)));
+  }
+  for(; i<n; i++) {y[i] = s*a[i];}
+}
+
+
+__attribute__((target("avx512f")))
+double hsumAVX512(const __m512d v) {
+  double buf[8];
+  _mm512_storeu_pd(buf,v);
+  return ((buf[0]+buf[1])+(buf[2]+buf[3]))+((buf[4]+buf[5])+(buf[6]+buf[7]));
+}
+
+
+__attribute__((target("avx512f")))
+double dotAVX512(const double* x, const double* a, const size_t n) {
+  __m512d vsum = _mm512_setzero_pd();
+  size_t i=0;
+  for(; i+8<=n; i+=8) {
+    vsum = _mm512_fmadd_pd(_mm512_loadu_pd(x+i),_mm512_loadu_pd(a+i),vsum);
+  }
+  if(i<n) {
+    __mmask8 mask = static_cast<__mmask8>((1u<<(n-i))-1);
+    vsum = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask,x+i),_mm512_maskz_loadu_pd(mask,a+i),vsum);
+  }
+  return hsumAVX512(vsum);
+}
+
+
+__attribute__((target("avx512f")))
+void dot2AVX512(const double* x, const double* a, const double* b, const size_t n, double& sum_a, double& sum_b) {
+  __m512d vsum_a = _mm512_setzero_pd();
+  __m512d vsum_b = _mm512_setzero_pd();
+  size_t i=0;
+  for(; i+8<=n; i+=8) {
+    __m512d vx = _mm512_loadu_pd(x+i);
+    vsum_a = _mm512_fmadd_pd(vx,_mm512_loadu_pd(a+i),vsum_a);
+    vsum_b = _mm512_fmadd_pd(vx,_mm512_loadu_pd(b+i),vsum_b);
+  }
+  if(i<n) {
+    __mmask8 mask = static_cast<__mmask8>((1u<<(n-i))-1);
+    __m512d vx = _mm512_maskz_loadu_pd(mask,x+i);
+    vsum_a = _mm512_fmadd_pd(vx,_mm512_maskz_loadu_pd(mask,a+i),vsum_a);
+    vsum_b = _mm512_fmadd_pd(vx,_mm512_maskz_loadu_pd(mask,b+i),vsum_b);
+  }
+  sum_a = hsumAVX512(vsum_a);
+  sum_b = hsumAVX512(vsum_b);
+}
+
+
+__attribute__((target("avx512f")))
+void scaleAVX512(double* y, const double* a, const double s, const size_t n) {
+  __m512d vs = _mm512_set1_pd(s);
+  size_t i=0;
+  for(; i+8<=n; i+=8) {
+    _mm512_storeu_pd(y+i,_mm512_mul_pd(vs,_mm512_loadu_pd(a+i)));
+  }
+  if(i<n) {
+    __mmask8 mask = static_cast<__mmask8>((1u<<(n-i))-1);
+    _mm512_mask_storeu_pd(y+i,mask,_mm512_mul_pd(vs,_mm512_maskz_loadu_pd(mask,a+i)));
+  }
+}
+
+#endif
+
+
+RowKernels selectRowKernels() {
+  RowKernels kernels = {dotScalar,dot2Scalar,scaleScalar,"scalar"};
+#ifdef VES_EXPANSION_X86_KERNELS
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")) {
+    RowKernels avx512 = {dotAVX512,dot2AVX512,scaleAVX512,"AVX-512"};
+    kernels = avx512;
+  }
+  else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    RowKernels avx2 = {dotAVX2,dot2AVX2,scaleAVX2,"AVX2"};
+    kernels = avx2;
+  }
+#endif
+  return kernels;
+}
+
+
+const RowKernels& rowKernels() {
+  static const RowKernels kernels = selectRowKernels();
+  return kernels;
+}
+
+
+/*
+Contraction of the coefficient tensor for a fixed number of dimensions D.
+The block of coefficients starting at offset is contracted over dimensions
+0,...,D-1 by recursing on the slowest varying one, giving the value of the
+expansion (val) and its derivatives with respect to each argument (derivs).
+Only coefficients in [begin,end) are taken into account. Since D is known
+at compile time the loops over dimensions are unrolled and the partial
+results stay in registers instead of going through the workspace.
+*/
+template<unsigned int D>
+struct ExpansionKernel {
+  static void contract(const RowKernels& kernels, const double* coeffs, const std::vector< std::vector<double> >& bf_values, const std::vector< std::vector<double> >& bf_derivs, const size_t* block_sizes, const size_t offset, const size_t begin, const size_t end, double& val, double* derivs) {
+    const std::vector<double>& values_d = bf_values[D-1];
+    const std::vector<double>& derivs_d = bf_derivs[D-1];
+    const size_t size = block_sizes[D-1];
+    val = 0.0;
+    for(unsigned int k=0; k<D; k++) {derivs[k]=0.0;}
+    for(size_t i=0; i<values_d.size(); i++) {
+      size_t sub_offset = offset+i*size;
+      if(sub_offset+size<=begin || sub_offset>=end) {continue;}
+      double sub_val;
+      double sub_derivs[D-1];
+      ExpansionKernel<D-1>::contract(kernels,coeffs,bf_values,bf_derivs,block_sizes,sub_offset,begin,end,sub_val,sub_derivs);
+      val += values_d[i]*sub_val;
+      for(unsigned int k=0; k<D-1; k++) {derivs[k] += values_d[i]*sub_derivs[k];}
+      derivs[D-1] += derivs_d[i]*sub_val;
+    }
+  }
+};
+
+
+template<>
+struct ExpansionKernel<1> {
+  static void contract(const RowKernels& kernels, const double* coeffs, const std::vector< std::vector<double> >& bf_values, const std::vector< std::vector<double> >& bf_derivs, const size_t*, const size_t offset, const size_t begin, const size_t end, double& val, double* derivs) {
+    size_t row_begin = std::max(offset,begin);
+    size_t row_end = std::min(offset+bf_values[0].size(),end);
+    if(row_begin<row_end) {
+      size_t i = row_begin-offset;
+      kernels.dot2(coeffs+row_begin,&bf_values[0][i],&bf_derivs[0][i],row_end-row_begin,val,derivs[0]);
+    }
+    else {
+      val = 0.0;
+      derivs[0] = 0.0;
+    }
+  }
+};
+
+
+// below this number of coefficients per thread the OpenMP overhead dominates
+const size_t min_coeffs_per_thread = 4096;
+
+// a grid is rebuilt after this many delta updates to avoid the accumulation of rounding errors
+const unsigned int max_delta_grid_updates = 1000;
+
+
+/*
+Sums over many points at once. The tables of the basis functions are stored
+as bf_values[k][i*npoints+p], such that the innermost loops run over
+contiguous blocks of points and the sums over the points are matrix-matrix
+products. The points are processed in blocks that are small enough for the
+tables to stay in cache.
+*/
+const size_t batch_cache_size = 32768;
+
+
+template<unsigned int D>
+double contractCoeffsTensorFixed(const ExpansionWorkspace& workspace, const CoeffsVector* coeffs_pntr_in, double* bias_derivs, const size_t rank, const size_t stride, const unsigned int nthreads=1) {
+  plumed_dbg_assert(workspace.bf_values.size()==D);
+  size_t block_sizes[D];
+  block_sizes[0] = 1;
+  for(unsigned int k=1; k<D; k++) {block_sizes[k] = block_sizes[k-1]*workspace.bf_values[k-1].size();}
+  const RowKernels& kernels = rowKernels();
+  const double* coeffs = &((*coeffs_pntr_in)[0]);
+  size_t ncoeffs = coeffs_pntr_in->numberOfCoeffs();
+  size_t begin = (rank*ncoeffs)/stride;
+  size_t end = ((rank+1)*ncoeffs)/stride;
+  double bias = 0.0;
+  if(nthreads<=1) {
+    ExpansionKernel<D>::contract(kernels,coeffs,workspace.bf_values,workspace.bf_derivs,block_sizes,0,begin,end,bias,bias_derivs);
+    return bias;
+  }
+  // the block of this rank is split further between the threads, the
+  // ordered reduction keeps the result independent of the scheduling
+  for(unsigned int k=0; k<D; k++) {bias_derivs[k]=0.0;}
+  #pragma omp parallel for ordered schedule(static,1) num_threads(nthreads)
+  for(unsigned int t=0; t<nthreads; t++) {
+    double bias_thread;
+    double derivs_thread[D];
+    size_t begin_thread = begin + (t*(end-begin))/nthreads;
+    size_t end_thread = begin + ((t+1)*(end-begin))/nthreads;
+    ExpansionKernel<D>::contract(kernels,coeffs,workspace.bf_values,workspace.bf_derivs,block_sizes,0,begin_thread,end_thread,bias_thread,derivs_thread);
+    #pragma omp ordered
+    {
+      bias += bias_thread;
+      for(unsigned int k=0; k<D; k++) {bias_derivs[k] += derivs_thread[k];}
+    }
+  }
+  return bias;
+}
+
+}
+
+
+ExpansionWorkspace::ExpansionWorkspace(const std::vector<BasisFunctions*>& basisf_pntrs_in) {
+  resize(basisf_pntrs_in);
+}
+
+
+void ExpansionWorkspace::resize(const std::vector<BasisFunctions*>& basisf_pntrs_in) {
+  unsigned int nargs = basisf_pntrs_in.size();
+  args_values_trsfrm.assign(nargs,0.0);
+  bf_values.resize(nargs);
+  bf_derivs.resize(nargs);
+  size_t ncoeffs = 1;
+  for(unsigned int k=0; k<nargs; k++) {
+    unsigned int nbf = basisf_pntrs_in[k]->getNumberOfBasisFunctions();
+    plumed_massert(nbf<=std::numeric_limits<unsigned short>::max(),"too many basis functions for the multi-index table");
+    bf_values[k].assign(nbf,0.0);
+    bf_derivs[k].assign(nbf,0.0);
+    ncoeffs *= nbf;
+  }
+  // multi-index table, the first dimension runs fastest as in CoeffsBase
+  coeffs_indices.assign(nargs,std::vector<unsigned short>(ncoeffs,0));
+  coeffs_strides.assign(nargs,1);
+  for(unsigned int k=1; k<nargs; k++) {coeffs_strides[k]=coeffs_strides[k-1]*bf_values[k-1].size();}
+  std::vector<unsigned short> indices(nargs,0);
+  for(size_t i=0; i<ncoeffs; i++) {
+    for(unsigned int k=0; k<nargs; k++) {coeffs_indices[k][i]=indices[k];}
+    for(unsigned int k=0; k<nargs; k++) {
+      if(++indices[k]<bf_values[k].size()) {break;}
+      indices[k]=0;
+    }
+  }
+  // partial tensors left after contracting the first dimension
+  size_t nrows = 0;
+  if(nargs>0) {nrows = ncoeffs/bf_values[0].size();}
+  ptensor_val.assign(nrows,0.0);
+  ptensor_der.assign(nargs,std::vector<double>(nrows,0.0));
+  forces.assign(nargs,0.0);
+  basisset_values.assign(ncoeffs,0.0);
+  partial_products.assign(nargs+1,0.0);
+  support.resize(nargs);
+  for(unsigned int k=0; k<nargs; k++) {support[k].reserve(bf_values[k].size());}
+  support_pos.assign(nargs,0);
+  batch_bf_values.resize(nargs);
+  batch_products.resize(2);
+}
+
+
 void LinearBasisSetExpansion::registerKeywords(Keywords& keys) {
 }
 
 
+void LinearBasisSetExpansion::setupSparseEvaluation(const std::vector<size_t>& active_coeffs) {
+  active_coeffs_ = active_coeffs;
+  std::sort(active_coeffs_.begin(),active_coeffs_.end());
+  active_coeffs_.erase(std::unique(active_coeffs_.begin(),active_coeffs_.end()),active_coeffs_.end());
+  for(size_t a=0; a<active_coeffs_.size(); a++) {
+    plumed_massert(active_coeffs_[a]<ncoeffs_,"index of active coefficient out of range");
+  }
+  sparse_evaluation_ = true;
+}
+
+
+void LinearBasisSetExpansion::disableSparseEvaluation() {
+  sparse_evaluation_ = false;
+  active_coeffs_.clear();
+}
+
+
+double LinearBasisSetExpansion::getBiasAndForcesSparse(const std::vector<double>& args_values, bool& all_inside, std::vector<double>& forces, std::vector<double>& coeffsderivs_values) {
+  plumed_dbg_assert(sparse_evaluation_);
+  plumed_assert(forces.size()==nargs_);
+  plumed_assert(coeffsderivs_values.size()==ncoeffs_);
+  getBasisFunctionValues(args_values,all_inside,basisf_pntrs_,workspace_);
+  // only the entries of the active coefficients are written, the others
+  // are expected to stay zero
+  const std::vector< std::vector<double> >& bf_values = workspace_.bf_values;
+  const std::vector< std::vector<unsigned short> >& indices = workspace_.coeffs_indices;
+  for(size_t a=0; a<active_coeffs_.size(); a++) {
+    size_t i = active_coeffs_[a];
+    double value = 1.0;
+    for(unsigned int k=0; k<nargs_; k++) {value *= bf_values[k][indices[k][i]];}
+    coeffsderivs_values[i] = value;
+  }
+  return contractCoeffsList(active_coeffs_,forces);
+}
+
+
+double LinearBasisSetExpansion::getBiasAndForces(const std::vector<double>& args_values, bool& all_inside, std::vector<double>& forces, std::vector<double>& coeffsderivs_values, std::vector<size_t>& support_coeffs) {
+  plumed_assert(forces.size()==nargs_);
+  plumed_assert(coeffsderivs_values.size()==ncoeffs_);
+  getBasisFunctionValues(args_values,all_inside,basisf_pntrs_,workspace_);
+  size_t support_size = findSupport();
+  // each coefficient in the support block costs about nargs operations more
+  // than in the full contraction, which writes all the basis set values
+  if(support_size*nargs_>=ncoeffs_) {
+    support_coeffs.clear();
+    return contractExpansion(workspace_,bias_coeffs_pntr_,forces,&coeffsderivs_values,serial_ ? NULL : &mycomm_);
+  }
+  // reset the entries written in the previous call, all of them if the full
+  // expansion was used
+  if(support_coeffs.size()>0) {
+    for(size_t a=0; a<support_coeffs.size(); a++) {coeffsderivs_values[support_coeffs[a]]=0.0;}
+  }
+  else {
+    std::fill(coeffsderivs_values.begin(),coeffsderivs_values.end(),0.0);
+  }
+  enumerateSupport(support_coeffs,&coeffsderivs_values);
+  return contractCoeffsList(support_coeffs,forces);
+}
+
+
+double LinearBasisSetExpansion::getBiasAndForcesWithoutBasisSetValues(const std::vector<double>& args_values, bool& all_inside, std::vector<double>& forces) {
+  plumed_assert(forces.size()==nargs_);
+  getBasisFunctionValues(args_values,all_inside,basisf_pntrs_,workspace_);
+  if(sparse_evaluation_) {
+    return contractCoeffsList(active_coeffs_,forces);
+  }
+  size_t support_size = findSupport();
+  if(support_size*nargs_>=ncoeffs_) {
+    return contractExpansion(workspace_,bias_coeffs_pntr_,forces,NULL,serial_ ? NULL : &mycomm_);
+  }
+  enumerateSupport(workspace_.support_coeffs,NULL);
+  return contractCoeffsList(workspace_.support_coeffs,forces);
+}
+
+
+size_t LinearBasisSetExpansion::findSupport() {
+  // non-zero basis functions in each dimension, the constant basis function
+  // of the localized basis sets is included in this way
+  std::vector< std::vector<unsigned int> >& support = workspace_.support;
+  size_t support_size = 1;
+  for(unsigned int k=0; k<nargs_; k++) {
+    support[k].clear();
+    for(unsigned int i=0; i<nbasisf_[k]; i++) {
+      if(workspace_.bf_values[k][i]!=0.0 || workspace_.bf_derivs[k][i]!=0.0) {support[k].push_back(i);}
+    }
+    support_size *= support[k].size();
+  }
+  return support_size;
+}
+
+
+void LinearBasisSetExpansion::enumerateSupport(std::vector<size_t>& support_coeffs, std::vector<double>* coeffsderivs_values) {
+  // enumerate the block, the first dimension runs fastest such that the
+  // indices are sorted
+  const std::vector< std::vector<unsigned int> >& support = workspace_.support;
+  size_t support_size = 1;
+  for(unsigned int k=0; k<nargs_; k++) {support_size *= support[k].size();}
+  support_coeffs.resize(support_size);
+  std::vector<unsigned int>& pos = workspace_.support_pos;
+  std::fill(pos.begin(),pos.end(),0);
+  for(size_t a=0; a<support_size; a++) {
+    size_t i = 0;
+    double value = 1.0;
+    for(unsigned int k=0; k<nargs_; k++) {
+      unsigned int idx = support[k][pos[k]];
+      i += idx*workspace_.coeffs_strides[k];
+      value *= workspace_.bf_values[k][idx];
+    }
+    support_coeffs[a] = i;
+    if(coeffsderivs_values!=NULL) {(*coeffsderivs_values)[i] = value;}
+    for(unsigned int k=0; k<nargs_; k++) {
+      if(++pos[k]<support[k].size()) {break;}
+      pos[k]=0;
+    }
+  }
+}
+
+
+double LinearBasisSetExpansion::contractCoeffsList(const std::vector<size_t>& coeffs_list, std::vector<double>& forces) {
+  const std::vector< std::vector<double> >& bf_values = workspace_.bf_values;
+  const std::vector< std::vector<double> >& bf_derivs = workspace_.bf_derivs;
+  const std::vector< std::vector<unsigned short> >& indices = workspace_.coeffs_indices;
+  std::vector<double>& prefix = workspace_.partial_products;
+  size_t stride=1;
+  size_t rank=0;
+  if(!serial_) {
+    stride=mycomm_.Get_size();
+    rank=mycomm_.Get_rank();
+  }
+  const double* coeffs = &((*bias_coeffs_pntr_)[0]);
+  double bias=0.0;
+  for(unsigned int k=0; k<nargs_; k++) {forces[k]=0.0;}
+  for(size_t a=rank; a<coeffs_list.size(); a+=stride) {
+    size_t i = coeffs_list[a];
+    // the derivative along k is c * prod_{l<k} f_l * f'_k * prod_{l>k} f_l
+    prefix[0] = 1.0;
+    for(unsigned int k=0; k<nargs_; k++) {
+      prefix[k+1] = prefix[k]*bf_values[k][indices[k][i]];
+    }
+    bias += coeffs[i]*prefix[nargs_];
+    double suffix = coeffs[i];
+    for(unsigned int k=nargs_; k>0; k--) {
+      unsigned int idx = indices[k-1][i];
+      forces[k-1] += suffix*prefix[k-1]*bf_derivs[k-1][idx];
+      suffix *= bf_values[k-1][idx];
+    }
+  }
+  if(!serial_) {
+    mycomm_.Sum(bias);
+    mycomm_.Sum(forces);
+  }
+  for(unsigned int k=0; k<nargs_; k++) {
+    forces[k] = -forces[k];
+  }
+  return bias;
+}
+
+
+bool LinearBasisSetExpansion::replicatedEvaluationPreferred(const size_t ncoeffs, const unsigned int nranks, const double crossover) {
+  /*
+  Splitting the coefficients over the ranks saves the evaluation of
+  ncoeffs*(nranks-1)/nranks coefficients per rank, at the price of reducing
+  the bias and the forces, whose cost grows about as log2(nranks). The
+  crossover is the number of coefficients that can be evaluated in the time
+  of one step of the reduction.
+  */
+  if(nranks<=1) {return true;}
+  double nsteps = std::ceil(std::log2(static_cast<double>(nranks)));
+  double saved = static_cast<double>(ncoeffs)*(nranks-1)/nranks;
+  return saved <= crossover*nsteps;
+}
+
+
+std::string LinearBasisSetExpansion::getKernelsName() {
+  return rowKernels().name;
+}
+
+
 LinearBasisSetExpansion::LinearBasisSetExpansion(
   const std::string& label,
   const double beta_in,
@@ -68,16 +582,30 @@ LinearBasisSetExpansion::LinearBasisSetExpansion(
   grid_max_(nargs_),
   grid_bins_(nargs_,100),
   targetdist_grid_label_("targetdist"),
-  step_of_last_biasgrid_update(-1000),
-  step_of_last_biaswithoutcutoffgrid_update(-1000),
-  step_of_last_fesgrid_update(-1000),
+  coeffs_version_(1),
+  targetdist_version_(1),
+  biasgrid_coeffs_version_(0),
+  biaswithoutcutoffgrid_coeffs_version_(0),
+  fesgrid_coeffs_version_(0),
+  fesgrid_targetdist_version_(0),
+  targetdist_coeffs_version_(0),
   bias_grid_pntr_(NULL),
   bias_withoutcutoff_grid_pntr_(NULL),
   fes_grid_pntr_(NULL),
+  bias_interp_grid_pntr_(NULL),
   log_targetdist_grid_pntr_(NULL),
   targetdist_grid_pntr_(NULL),
   targetdist_pntr_(NULL),
+  grid_delta_tolerance_(0.0),
+  sparse_evaluation_(false),
+  active_coeffs_(0),
+  reweight_factor_active_(false),
   reweight_factor(0.0),
+  reweight_factor_revised(0.0),
+  reweight_factor_coeffs_version_(0),
+  reweight_factor_targetdist_version_(0),
+  reweight_factor_revised_coeffs_version_(0),
+  reweight_factor_revised_targetdist_version_(0),
   reweight_min_(nargs_),
   reweight_max_(nargs_),
   reweight_bins_(nargs_,100),
@@ -98,6 +626,8 @@ LinearBasisSetExpansion::LinearBasisSetExpansion(
   //
   ncoeffs_ = bias_coeffs_pntr_->numberOfCoeffs();
   targetdist_averages_pntr_ = new CoeffsVector(*bias_coeffs_pntr_);
+  workspace_.resize(basisf_pntrs_);
+  batch_workspace_.resize(basisf_pntrs_);
 
   std::string targetdist_averages_label = bias_coeffs_pntr_->getLabel();
   if(targetdist_averages_label.find("coeffs")!=std::string::npos) {
@@ -127,6 +657,9 @@ LinearBasisSetExpansion::~LinearBasisSetExpansion() {
   if(fes_grid_pntr_!=NULL) {
     delete fes_grid_pntr_;
   }
+  if(bias_interp_grid_pntr_!=NULL) {
+    delete bias_interp_grid_pntr_;
+  }
   // Added by Y. Isaac Yang to calculate the reweighting factor
   if(bias_rwgrid_pntr_!=NULL){
     delete bias_rwgrid_pntr_;
@@ -218,6 +751,95 @@ void LinearBasisSetExpansion::setupBiasGrid(const bool usederiv) {
 }
 
 
+void LinearBasisSetExpansion::setupBiasInterpolation(const std::vector<unsigned int>& interp_grid_bins) {
+  plumed_massert(interp_grid_bins.size()==nargs_,"the number of interpolation grid bins given doesn't match the number of arguments");
+  plumed_massert(bias_interp_grid_pntr_==NULL,"the bias interpolation grid has already been setup");
+  bool use_spline = true;
+  bool usederiv = true;
+  bias_interp_grid_pntr_ = new Grid(label_+".bias_interpolation",args_pntrs_,grid_min_,grid_max_,interp_grid_bins,use_spline,usederiv);
+  // the spline needs the derivatives of the bias, while the bias grid stores the forces
+  bool bias_derivatives = true;
+  fillBiasGrid(bias_interp_grid_pntr_,biasCutoffActive(),bias_derivatives);
+}
+
+
+double LinearBasisSetExpansion::getBiasAndForcesFromGrid(const std::vector<double>& args_values, bool& all_inside, std::vector<double>& forces) {
+  plumed_dbg_assert(bias_interp_grid_pntr_!=NULL);
+  std::vector<double>& args_grid = workspace_.args_values_trsfrm;
+  all_inside = true;
+  // outside the interval of non-periodic basis functions the bias does not
+  // depend on the argument, as is the case for the expansion itself
+  for(unsigned int k=0; k<nargs_; k++) {
+    args_grid[k] = args_values[k];
+    if(!basisf_pntrs_[k]->arePeriodic()) {
+      if(args_values[k]<basisf_pntrs_[k]->intervalMin()) {
+        args_grid[k] = basisf_pntrs_[k]->intervalMin();
+        all_inside = false;
+      }
+      else if(args_values[k]>basisf_pntrs_[k]->intervalMax()) {
+        args_grid[k] = basisf_pntrs_[k]->intervalMax();
+        all_inside = false;
+      }
+    }
+  }
+  double bias = bias_interp_grid_pntr_->getValueAndDerivatives(args_grid,forces);
+  for(unsigned int k=0; k<nargs_; k++) {
+    forces[k] = (args_grid[k]==args_values[k]) ? -forces[k] : 0.0;
+  }
+  return bias;
+}
+
+
+void LinearBasisSetExpansion::getBiasInterpolationError(double& max_error, double& rms_error, double& max_force_error) {
+  plumed_massert(bias_interp_grid_pntr_!=NULL,"the bias interpolation grid is not defined");
+  // compare with the expansion at the centers of the grid cells, where the
+  // interpolation error is the largest
+  const std::vector<double>& dx = bias_interp_grid_pntr_->getDx();
+  const std::vector<unsigned int>& nbin = bias_interp_grid_pntr_->getNbin();
+  std::vector<bool> periodic = bias_interp_grid_pntr_->getIsPeriodic();
+  std::vector<double> forces(nargs_);
+  std::vector<double> forces_grid(nargs_);
+  max_error = 0.0;
+  rms_error = 0.0;
+  max_force_error = 0.0;
+  // the points are split between the ranks and the expansion is evaluated
+  // locally, such that only the errors are reduced at the end, this is done
+  // for any evaluation mode as it is independent of the per step evaluation
+  unsigned int stride = mycomm_.Get_size();
+  unsigned int rank = mycomm_.Get_rank();
+  double npoints = 0.0;
+  for(Grid::index_t l=rank; l<bias_interp_grid_pntr_->getSize(); l+=stride) {
+    std::vector<unsigned int> indices = bias_interp_grid_pntr_->getIndices(l);
+    bool last_point = false;
+    for(unsigned int k=0; k<nargs_; k++) {
+      if(!periodic[k] && indices[k]+1>=nbin[k]) {last_point=true;}
+    }
+    if(last_point) {continue;}
+    std::vector<double> args = bias_interp_grid_pntr_->getPoint(l);
+    for(unsigned int k=0; k<nargs_; k++) {args[k] += 0.5*dx[k];}
+    bool all_inside=true;
+    double bias=getBiasAndForces(args,all_inside,forces,workspace_.basisset_values,basisf_pntrs_,bias_coeffs_pntr_,workspace_);
+    if(biasCutoffActive()) {
+      vesbias_pntr_->applyBiasCutoff(bias,forces);
+    }
+    double error = std::fabs(bias-getBiasAndForcesFromGrid(args,all_inside,forces_grid));
+    max_error = std::max(max_error,error);
+    rms_error += error*error;
+    for(unsigned int k=0; k<nargs_; k++) {
+      max_force_error = std::max(max_force_error,std::fabs(forces[k]-forces_grid[k]));
+    }
+    npoints++;
+  }
+  if(stride>1) {
+    mycomm_.Max(max_error);
+    mycomm_.Max(max_force_error);
+    mycomm_.Sum(rms_error);
+    mycomm_.Sum(npoints);
+  }
+  if(npoints>0) {rms_error = std::sqrt(rms_error/npoints);}
+}
+
+
 void LinearBasisSetExpansion::setupFesGrid() {
   if(fes_grid_pntr_!=NULL) {return;}
   if(bias_grid_pntr_==NULL) {
@@ -238,176 +860,497 @@ void LinearBasisSetExpansion::setupFesProjGrid() {
 }
 
 
-void LinearBasisSetExpansion::updateBiasGrid() {
-  plumed_massert(bias_grid_pntr_!=NULL,"the bias grid is not defined");
-  if(action_pntr_!=NULL &&  getStepOfLastBiasGridUpdate()==action_pntr_->getStep()) {
-    return;
-  }
-  for(Grid::index_t l=0; l<bias_grid_pntr_->getSize(); l++) {
-    std::vector<double> forces(nargs_);
-    std::vector<double> args = bias_grid_pntr_->getPoint(l);
-    bool all_inside=true;
-    double bias=getBiasAndForces(args,all_inside,forces);
-    //
-    if(biasCutoffActive()) {
-      vesbias_pntr_->applyBiasCutoff(bias,forces);
-    }
-    //
-    if(bias_grid_pntr_->hasDerivatives()) {
-      bias_grid_pntr_->setValueAndDerivatives(l,bias,forces);
+void LinearBasisSetExpansion::contractBiasOnGrid(const Grid* grid_pntr, const bool with_derivatives, std::vector<double>& bias, std::vector< std::vector<double> >& derivs, const bool delta_update) {
+  if(delta_update) {
+    GridBiasCache& cache = grid_bias_cache_[grid_pntr];
+    if(updateBiasOnGridFromDelta(grid_pntr,with_derivatives,cache)) {
+      bias = cache.bias;
+      derivs.resize(with_derivatives ? nargs_ : 0);
+      for(unsigned int k=0; k<derivs.size(); k++) {derivs[k] = cache.derivs[k];}
+      return;
     }
-    else {
-      bias_grid_pntr_->setValue(l,bias);
+  }
+  // the grid points form a tensor product lattice such that the expansion
+  // is contracted with the tables of the basis functions along each dimension
+  const GridBasisTables& tables = getGridBasisTables(grid_pntr);
+  unsigned int noutputs = with_derivatives ? nargs_+1 : 1;
+  /*
+  The points of the last dimension are split into contiguous blocks between
+  the ranks such that each rank fills a contiguous block of the grid without
+  any communication. The bias and the derivatives of the block are stored
+  one after the other and the full grid is obtained with a single allgather.
+  The grid is always split, also when the expansion is evaluated serially at
+  each step.
+  */
+  unsigned int stride = mycomm_.Get_size();
+  unsigned int rank = mycomm_.Get_rank();
+  unsigned int np_last = tables.npoints[nargs_-1];
+  size_t npoints_slice = grid_pntr->getSize()/np_last;
+  std::vector<unsigned int> p_begin(stride+1);
+  std::vector<int> counts(stride);
+  std::vector<int> displs(stride);
+  for(unsigned int r=0; r<=stride; r++) {p_begin[r] = (r*np_last)/stride;}
+  for(unsigned int r=0; r<stride; r++) {
+    counts[r] = noutputs*npoints_slice*(p_begin[r+1]-p_begin[r]);
+    displs[r] = (r==0) ? 0 : displs[r-1]+counts[r-1];
+  }
+  //
+  std::vector<const std::vector<double>*> table_pntrs(nargs_);
+  for(unsigned int k=0; k<nargs_; k++) {table_pntrs[k] = &tables.values[k];}
+  std::vector<double> local_values;
+  local_values.reserve(counts[rank]);
+  std::vector<double> output;
+  contractCoeffsOnGrid(table_pntrs,tables.npoints,p_begin[rank],p_begin[rank+1],output);
+  local_values.insert(local_values.end(),output.begin(),output.end());
+  // the derivative along dimension m uses the derivatives of the basis functions for that dimension
+  if(with_derivatives) {
+    for(unsigned int m=0; m<nargs_; m++) {
+      table_pntrs[m] = &tables.derivs[m];
+      contractCoeffsOnGrid(table_pntrs,tables.npoints,p_begin[rank],p_begin[rank+1],output);
+      local_values.insert(local_values.end(),output.begin(),output.end());
+      table_pntrs[m] = &tables.values[m];
     }
-    //
   }
-  // Added by Y. Isaac Yang to calculate the reweighting factor
-  if(isReweightGridActive())
-  {
-	for(Grid::index_t l=0; l<bias_rwgrid_pntr_->getSize(); l++){
-      std::vector<double> forces(nargs_);
-      std::vector<double> args = bias_rwgrid_pntr_->getPoint(l);
-      bool all_inside=true;
-      double bias=getBiasAndForces(args,all_inside,forces);
-
-      if(bias_rwgrid_pntr_->hasDerivatives()){
-        bias_rwgrid_pntr_->setValueAndDerivatives(l,bias,forces);
-      }
-      else{
-        bias_rwgrid_pntr_->setValue(l,bias);
-      }
+  std::vector<double> values;
+  if(stride>1) {
+    values.assign(displs[stride-1]+counts[stride-1],0.0);
+    mycomm_.Allgatherv(local_values,values,&counts[0],&displs[0]);
+  }
+  else {
+    values.swap(local_values);
+  }
+  // the blocks of the ranks are put back in the order of the grid
+  bias.resize(grid_pntr->getSize());
+  derivs.resize(with_derivatives ? nargs_ : 0);
+  for(unsigned int k=0; k<derivs.size(); k++) {derivs[k].resize(grid_pntr->getSize());}
+  for(unsigned int r=0; r<stride; r++) {
+    size_t nblock = npoints_slice*(p_begin[r+1]-p_begin[r]);
+    if(nblock==0) {continue;}
+    const double* block = &values[0]+displs[r];
+    Grid::index_t l0 = npoints_slice*p_begin[r];
+    std::copy(block,block+nblock,bias.begin()+l0);
+    for(unsigned int k=0; k<derivs.size(); k++) {
+      std::copy(block+(k+1)*nblock,block+(k+2)*nblock,derivs[k].begin()+l0);
     }
   }
   //
-  if(vesbias_pntr_!=NULL) {
-    vesbias_pntr_->setCurrentBiasMaxValue(bias_grid_pntr_->getMaxValue());
-  }
-  if(action_pntr_!=NULL) {
-    setStepOfLastBiasGridUpdate(action_pntr_->getStep());
+  if(delta_update) {
+    GridBiasCache& cache = grid_bias_cache_[grid_pntr];
+    const double* coeffs = &((*bias_coeffs_pntr_)[0]);
+    cache.coeffs.assign(coeffs,coeffs+ncoeffs_);
+    cache.bias = bias;
+    cache.derivs = derivs;
+    cache.with_derivatives = with_derivatives;
+    cache.ndelta_updates = 0;
   }
 }
 
 
-void LinearBasisSetExpansion::updateBiasWithoutCutoffGrid() {
-  plumed_massert(bias_withoutcutoff_grid_pntr_!=NULL,"the bias without cutoff grid is not defined");
-  plumed_massert(biasCutoffActive(),"the bias cutoff has to be active");
-  plumed_massert(vesbias_pntr_!=NULL,"has to be linked to a VesBias to work");
-  if(action_pntr_!=NULL &&  getStepOfLastBiasWithoutCutoffGridUpdate()==action_pntr_->getStep()) {
-    return;
+bool LinearBasisSetExpansion::updateBiasOnGridFromDelta(const Grid* grid_pntr, const bool with_derivatives, GridBiasCache& cache) {
+  /*
+  The change of the bias is dV(s) = sum_i dalpha_i f_i(s) over the
+  coefficients that changed more than the tolerance since the cached grid was
+  obtained, where each term is an outer product of columns of the tables of
+  the basis functions. The changes below the tolerance are kept in the cached
+  coefficients until they exceed it. Each term costs one operation per grid
+  point such that the full contraction is used when the change is dense.
+  */
+  if(cache.coeffs.empty() || (with_derivatives && !cache.with_derivatives)) {return false;}
+  if(cache.ndelta_updates>=max_delta_grid_updates) {return false;}
+  const GridBasisTables& tables = getGridBasisTables(grid_pntr);
+  const double* coeffs = &((*bias_coeffs_pntr_)[0]);
+  std::vector<size_t> changed_coeffs;
+  std::vector<double> delta;
+  for(size_t i=0; i<ncoeffs_; i++) {
+    double d = coeffs[i]-cache.coeffs[i];
+    if(std::fabs(d)>grid_delta_tolerance_) {
+      changed_coeffs.push_back(i);
+      delta.push_back(d);
+    }
+  }
+  // operations of the full contraction, which is split between the ranks
+  double full_cost = 0.0;
+  size_t nrows_a = 1;
+  size_t nrows_b = ncoeffs_;
+  for(unsigned int k=0; k<nargs_; k++) {
+    nrows_b /= nbasisf_[k];
+    full_cost += static_cast<double>(nrows_a*tables.npoints[k]*nrows_b*nbasisf_[k]);
+    nrows_a *= tables.npoints[k];
   }
+  unsigned int stride = mycomm_.Get_size();
+  if(static_cast<double>(changed_coeffs.size())*grid_pntr->getSize() >= full_cost/stride) {return false;}
   //
-  for(Grid::index_t l=0; l<bias_withoutcutoff_grid_pntr_->getSize(); l++) {
-    std::vector<double> forces(nargs_);
-    std::vector<double> args = bias_withoutcutoff_grid_pntr_->getPoint(l);
-    bool all_inside=true;
-    double bias=getBiasAndForces(args,all_inside,forces);
-    if(bias_withoutcutoff_grid_pntr_->hasDerivatives()) {
-      bias_withoutcutoff_grid_pntr_->setValueAndDerivatives(l,bias,forces);
-    }
-    else {
-      bias_withoutcutoff_grid_pntr_->setValue(l,bias);
+  std::vector<const std::vector<double>*> table_pntrs(nargs_);
+  for(unsigned int k=0; k<nargs_; k++) {table_pntrs[k] = &tables.values[k];}
+  addCoeffsDeltaOnGrid(table_pntrs,tables.npoints,changed_coeffs,delta,cache.bias);
+  if(cache.with_derivatives) {
+    for(unsigned int m=0; m<nargs_; m++) {
+      table_pntrs[m] = &tables.derivs[m];
+      addCoeffsDeltaOnGrid(table_pntrs,tables.npoints,changed_coeffs,delta,cache.derivs[m]);
+      table_pntrs[m] = &tables.values[m];
     }
   }
-  // Added by Y. Isaac Yang to calculate the reweighting factor
-  if(isReweightGridActive())
-  {
-	for(Grid::index_t l=0; l<bias_withoutcutoff_rwgrid_pntr_->getSize(); l++){
-      std::vector<double> forces(nargs_);
-      std::vector<double> args = bias_withoutcutoff_rwgrid_pntr_->getPoint(l);
-      bool all_inside=true;
-      double bias=getBiasAndForces(args,all_inside,forces);
-      if(bias_withoutcutoff_rwgrid_pntr_->hasDerivatives()){
-        bias_withoutcutoff_rwgrid_pntr_->setValueAndDerivatives(l,bias,forces);
+  for(size_t c=0; c<changed_coeffs.size(); c++) {
+    cache.coeffs[changed_coeffs[c]] = coeffs[changed_coeffs[c]];
+  }
+  cache.ndelta_updates++;
+  return true;
+}
+
+
+void LinearBasisSetExpansion::addCoeffsDeltaOnGrid(const std::vector<const std::vector<double>*>& tables, const std::vector<unsigned int>& npoints, const std::vector<size_t>& coeffs_indices, const std::vector<double>& delta, std::vector<double>& result) const {
+  // the grid is split into rows along the first dimension, which are independent
+  // and divided between the threads, each row gets the terms of all the changed coefficients
+  const std::vector< std::vector<unsigned short> >& indices = workspace_.coeffs_indices;
+  size_t nrow = npoints[0];
+  size_t nrows = result.size()/nrow;
+  size_t nchanged = coeffs_indices.size();
+  if(nrows==0 || nchanged==0) {return;}
+  unsigned int nthreads = 1;
+  if(result.size()>=2*min_coeffs_per_thread) {
+    nthreads = std::min<size_t>(OpenMP::getNumThreads(),result.size()/min_coeffs_per_thread);
+  }
+  nthreads = std::min<size_t>(nthreads,nrows);
+  const std::vector<double>& table0 = *tables[0];
+  unsigned int nbf0 = nbasisf_[0];
+  #pragma omp parallel for num_threads(nthreads)
+  for(unsigned int t=0; t<nthreads; t++) {
+    size_t r_begin = (t*nrows)/nthreads;
+    size_t r_end = ((t+1)*nrows)/nthreads;
+    // grid index of the first row in the remaining dimensions, then advanced row by row
+    std::vector<unsigned int> row_point(nargs_,0);
+    size_t rest = r_begin;
+    for(unsigned int k=1; k<nargs_; k++) {
+      row_point[k] = rest%npoints[k];
+      rest /= npoints[k];
+    }
+    for(size_t r=r_begin; r<r_end; r++) {
+      double* out = &result[r*nrow];
+      for(size_t c=0; c<nchanged; c++) {
+        size_t i = coeffs_indices[c];
+        double factor = delta[c];
+        for(unsigned int k=1; k<nargs_ && factor!=0.0; k++) {
+          factor *= (*tables[k])[row_point[k]*nbasisf_[k]+indices[k][i]];
+        }
+        if(factor==0.0) {continue;}
+        const double* column = &table0[indices[0][i]];
+        for(size_t p=0; p<nrow; p++) {out[p] += factor*column[p*nbf0];}
       }
-      else{
-        bias_withoutcutoff_rwgrid_pntr_->setValue(l,bias);
+      for(unsigned int k=1; k<nargs_; k++) {
+        if(++row_point[k]<npoints[k]) {break;}
+        row_point[k]=0;
       }
-	}
+    }
   }
+}
+
+
+void LinearBasisSetExpansion::fillBiasGrid(Grid* grid_pntr, const bool apply_cutoff, const bool bias_derivatives) {
+  bool has_derivatives = grid_pntr->hasDerivatives();
+  std::vector<double> bias;
+  std::vector< std::vector<double> > derivs;
+  contractBiasOnGrid(grid_pntr,has_derivatives,bias,derivs);
   //
-  double bias_max = bias_withoutcutoff_grid_pntr_->getMaxValue();
-  double bias_min = bias_withoutcutoff_grid_pntr_->getMinValue();
-  double shift = 0.0;
-  bool bias_shifted=false;
-  if(bias_min < 0.0) {
-    shift += -bias_min;
-    bias_shifted=true;
-    BiasCoeffs()[0] -= bias_min;
-    bias_max -= bias_min;
-  }
-  if(bias_max > vesbias_pntr_->getBiasCutoffValue()) {
-    shift += -(bias_max-vesbias_pntr_->getBiasCutoffValue());
-    bias_shifted=true;
-    BiasCoeffs()[0] -= (bias_max-vesbias_pntr_->getBiasCutoffValue());
-    bias_max -= (bias_max-vesbias_pntr_->getBiasCutoffValue());
-  }
-  if(bias_shifted) {
-    // this should be done inside a grid function really,
-    // need to define my grid class for that
-    for(Grid::index_t l=0; l<bias_withoutcutoff_grid_pntr_->getSize(); l++) {
-      if(bias_withoutcutoff_grid_pntr_->hasDerivatives()) {
-        std::vector<double> zeros(nargs_,0.0);
-        bias_withoutcutoff_grid_pntr_->addValueAndDerivatives(l,shift,zeros);
-      }
-      else {
-        bias_withoutcutoff_grid_pntr_->addValue(l,shift);
+  std::vector<double> forces_point(nargs_,0.0);
+  for(Grid::index_t l=0; l<grid_pntr->getSize(); l++) {
+    double bias_point = bias[l];
+    if(has_derivatives) {
+      for(unsigned int k=0; k<nargs_; k++) {forces_point[k]=-derivs[k][l];}
+    }
+    if(apply_cutoff) {
+      vesbias_pntr_->applyBiasCutoff(bias_point,forces_point);
+    }
+    if(has_derivatives) {
+      if(bias_derivatives) {
+        for(unsigned int k=0; k<nargs_; k++) {forces_point[k]=-forces_point[k];}
       }
+      grid_pntr->setValueAndDerivatives(l,bias_point,forces_point);
     }
-    // Added by Y. Isaac Yang to calculate the reweighting factor
-    if(isReweightGridActive())
-    {
-      for(Grid::index_t l=0; l<bias_withoutcutoff_rwgrid_pntr_->getSize(); l++){
-        if(bias_withoutcutoff_rwgrid_pntr_->hasDerivatives()){
-          std::vector<double> zeros(nargs_,0.0);
-          bias_withoutcutoff_rwgrid_pntr_->addValueAndDerivatives(l,shift,zeros);
-        }
-        else{
-          bias_withoutcutoff_rwgrid_pntr_->addValue(l,shift);
+    else {
+      grid_pntr->setValue(l,bias_point);
+    }
+  }
+}
+
+
+const GridBasisTables& LinearBasisSetExpansion::getGridBasisTables(const Grid* grid_pntr) {
+  std::map<const Grid*,GridBasisTables>::const_iterator it = grid_basis_tables_.find(grid_pntr);
+  if(it!=grid_basis_tables_.end()) {return it->second;}
+  //
+  GridBasisTables& tables = grid_basis_tables_[grid_pntr];
+  tables.npoints = grid_pntr->getNbin();
+  plumed_massert(tables.npoints.size()==nargs_,"the dimension of the grid doesn't match the number of arguments");
+  tables.values.resize(nargs_);
+  tables.derivs.resize(nargs_);
+  // the points along dimension k are obtained by keeping the other indices at zero
+  std::vector<unsigned int> indices(nargs_,0);
+  std::vector<double> point(nargs_);
+  for(unsigned int k=0; k<nargs_; k++) {
+    unsigned int nbf = nbasisf_[k];
+    tables.values[k].assign(tables.npoints[k]*nbf,0.0);
+    tables.derivs[k].assign(tables.npoints[k]*nbf,0.0);
+    std::vector<double> bf_values(nbf);
+    std::vector<double> bf_derivs(nbf);
+    for(unsigned int p=0; p<tables.npoints[k]; p++) {
+      indices[k] = p;
+      grid_pntr->getPoint(indices,point);
+      std::fill(bf_values.begin(),bf_values.end(),0.0);
+      std::fill(bf_derivs.begin(),bf_derivs.end(),0.0);
+      double arg_trsfrm = 0.0;
+      bool inside = true;
+      basisf_pntrs_[k]->getAllValues(point[k],arg_trsfrm,inside,bf_values,bf_derivs);
+      std::copy(bf_values.begin(),bf_values.end(),tables.values[k].begin()+p*nbf);
+      std::copy(bf_derivs.begin(),bf_derivs.end(),tables.derivs[k].begin()+p*nbf);
+    }
+    indices[k] = 0;
+  }
+  return tables;
+}
+
+
+void LinearBasisSetExpansion::contractCoeffsOnGrid(const std::vector<const std::vector<double>*>& tables, const std::vector<unsigned int>& npoints, const unsigned int p_begin_last, const unsigned int p_end_last, std::vector<double>& result) const {
+  /*
+  The coefficient tensor is contracted with the table of one dimension at the
+  time (mode-k product) such that the index of the basis function j_k is
+  replaced by the index of the grid point p_k. As the first dimension is the
+  fastest varying one, both for the coefficients and the grid, the partial
+  tensor is (A,n_k,B) where A are the grid points of the dimensions already
+  contracted and B the basis functions of the remaining ones, and each output
+  row of length A is a linear combination of n_k input rows.
+  Only the points [p_begin_last,p_end_last) of the last dimension are
+  computed, which is a contiguous block of the grid. The output rows of
+  different points are independent and are split between the threads.
+  */
+  std::vector<double> buffers[2];
+  const double* src = &((*bias_coeffs_pntr_)[0]);
+  size_t nrows_a = 1;
+  size_t nrows_b = ncoeffs_;
+  for(unsigned int k=0; k<nargs_; k++) {
+    const std::vector<double>& table = *tables[k];
+    unsigned int nbf = nbasisf_[k];
+    unsigned int p_first = 0;
+    unsigned int np = npoints[k];
+    if(k==nargs_-1) {
+      p_first = p_begin_last;
+      np = p_end_last-p_begin_last;
+    }
+    nrows_b /= nbf;
+    std::vector<double>& dst = buffers[k%2];
+    dst.assign(nrows_a*np*nrows_b,0.0);
+    unsigned int nthreads = 1;
+    if(dst.size()>=2*min_coeffs_per_thread) {
+      nthreads = std::min<size_t>(OpenMP::getNumThreads(),dst.size()/min_coeffs_per_thread);
+    }
+    #pragma omp parallel for num_threads(nthreads)
+    for(unsigned int p=0; p<np; p++) {
+      const double* table_row = &table[(p_first+p)*nbf];
+      for(size_t b=0; b<nrows_b; b++) {
+        double* out = &dst[nrows_a*(p+np*b)];
+        for(unsigned int j=0; j<nbf; j++) {
+          double f = table_row[j];
+          if(f==0.0) {continue;}
+          const double* in = src+nrows_a*(j+nbf*b);
+          for(size_t a=0; a<nrows_a; a++) {out[a] += f*in[a];}
         }
       }
-	}
+    }
+    src = dst.empty() ? NULL : &dst[0];
+    nrows_a *= np;
   }
-  if(vesbias_pntr_!=NULL) {
-    vesbias_pntr_->setCurrentBiasMaxValue(bias_max);
+  result.swap(buffers[(nargs_-1)%2]);
+}
+
+
+unsigned long int LinearBasisSetExpansion::getCoeffsVersion() const {
+  if(vesbias_pntr_!=NULL) {return vesbias_pntr_->getCoeffsVersion();}
+  else {return coeffs_version_;}
+}
+
+
+void LinearBasisSetExpansion::increaseCoeffsVersion() {
+  if(vesbias_pntr_!=NULL) {vesbias_pntr_->increaseCoeffsVersion();}
+  else {coeffs_version_++;}
+}
+
+
+void LinearBasisSetExpansion::updateBiasGrid() {
+  plumed_massert(bias_grid_pntr_!=NULL,"the bias grid is not defined");
+  if(biasgrid_coeffs_version_==getCoeffsVersion()) {
+    return;
   }
-  if(action_pntr_!=NULL) {
-    setStepOfLastBiasWithoutCutoffGridUpdate(action_pntr_->getStep());
+  sweepGrids(false);
+}
+
+
+void LinearBasisSetExpansion::updateBiasWithoutCutoffGrid() {
+  plumed_massert(bias_withoutcutoff_grid_pntr_!=NULL,"the bias without cutoff grid is not defined");
+  plumed_massert(biasCutoffActive(),"the bias cutoff has to be active");
+  plumed_massert(vesbias_pntr_!=NULL,"has to be linked to a VesBias to work");
+  if(biaswithoutcutoffgrid_coeffs_version_==getCoeffsVersion()) {
+    return;
   }
+  sweepGrids(true);
 }
 
 
 void LinearBasisSetExpansion::updateFesGrid() {
   plumed_massert(fes_grid_pntr_!=NULL,"the FES grid is not defined");
   updateBiasGrid();
-  if(action_pntr_!=NULL && getStepOfLastFesGridUpdate() == action_pntr_->getStep()) {
+  if(fesgrid_coeffs_version_==getCoeffsVersion() && fesgrid_targetdist_version_==targetdist_version_) {
     return;
   }
+  // the bias grid is up to date but the FES grid was not filled in the same
+  // sweep, e.g. as the target distribution changed since
+  fillFesGridFromBiasGrid(fes_grid_pntr_,bias_grid_pntr_,log_targetdist_grid_pntr_);
+  // Added by Y. Isaac Yang to calculate the reweighting factor
+  if(isReweightGridActive())
+  {
+    fillFesGridFromBiasGrid(fes_rwgrid_pntr_,bias_rwgrid_pntr_,log_reweight_grid_pntr_);
+  }
   //
+  fesgrid_coeffs_version_ = biasgrid_coeffs_version_;
+  fesgrid_targetdist_version_ = targetdist_version_;
+}
+
+
+void LinearBasisSetExpansion::fillFesGridFromBiasGrid(Grid* fes_pntr, const Grid* bias_pntr, const Grid* log_weights_pntr) {
   double bias2fes_scalingf = -1.0;
-  for(Grid::index_t l=0; l<fes_grid_pntr_->getSize(); l++) {
-    double fes_value = bias2fes_scalingf*bias_grid_pntr_->getValue(l);
-    if(log_targetdist_grid_pntr_!=NULL) {
-      fes_value += kBT()*log_targetdist_grid_pntr_->getValue(l);
+  for(Grid::index_t l=0; l<fes_pntr->getSize(); l++) {
+    double fes_value = bias2fes_scalingf*bias_pntr->getValue(l);
+    if(log_weights_pntr!=NULL) {
+      fes_value += kBT()*log_weights_pntr->getValue(l);
+    }
+    fes_pntr->setValue(l,fes_value);
+  }
+  fes_pntr->setMinToZero();
+}
+
+
+void LinearBasisSetExpansion::sweepGrids(const bool shift_bias) {
+  /*
+  All the grids are obtained from a single evaluation of the expansion on
+  each lattice (the bias grid and the reweight grid). The bias without
+  cutoff, the bias with the cutoff switched on, the FES and the log-sum-exp
+  sums of the reweighting factor c(t) are all written in the same pass over
+  the points. If shift_bias is true the bias without cutoff is shifted into
+  the range [0,cutoff] by changing the constant coefficient, as the raw
+  values are known before the pass the shift is simply added to them.
+  */
+  plumed_massert(bias_grid_pntr_!=NULL,"the bias grid is not defined");
+  std::vector<double> bias;
+  std::vector< std::vector<double> > derivs;
+  Grid* withoutcutoff_grid_pntr = shift_bias ? bias_withoutcutoff_grid_pntr_ : NULL;
+  bool with_derivatives = bias_grid_pntr_->hasDerivatives() || (withoutcutoff_grid_pntr!=NULL && withoutcutoff_grid_pntr->hasDerivatives());
+  contractBiasOnGrid(bias_grid_pntr_,with_derivatives,bias,derivs,true);
+  //
+  double shift = 0.0;
+  double bias_max = 0.0;
+  if(shift_bias) {
+    plumed_massert(biasCutoffActive(),"the bias cutoff has to be active");
+    bias_max = *std::max_element(bias.begin(),bias.end());
+    double bias_min = *std::min_element(bias.begin(),bias.end());
+    if(bias_min < 0.0) {
+      shift += -bias_min;
+      BiasCoeffs()[0] -= bias_min;
+      bias_max -= bias_min;
     }
-    fes_grid_pntr_->setValue(l,fes_value);
+    if(bias_max > vesbias_pntr_->getBiasCutoffValue()) {
+      shift += -(bias_max-vesbias_pntr_->getBiasCutoffValue());
+      BiasCoeffs()[0] -= (bias_max-vesbias_pntr_->getBiasCutoffValue());
+      bias_max -= (bias_max-vesbias_pntr_->getBiasCutoffValue());
+    }
+    if(shift!=0.0) {increaseCoeffsVersion();}
   }
-  fes_grid_pntr_->setMinToZero();
+  bool rw_lattice = isReweightGridActive();
+  const Grid* weights_pntr = reweight_factor_active_ ? (rw_lattice ? reweight_grid_pntr_ : targetdist_grid_pntr_) : NULL;
+  sweepGridLattice(bias,derivs,shift,biasCutoffActive(),bias_grid_pntr_,withoutcutoff_grid_pntr,fes_grid_pntr_,log_targetdist_grid_pntr_,rw_lattice ? NULL : weights_pntr);
   // Added by Y. Isaac Yang to calculate the reweighting factor
-  if(isReweightGridActive())
-  {
-	bias2fes_scalingf = -1.0;
-    for(Grid::index_t l=0; l<fes_rwgrid_pntr_->getSize(); l++){
-      double fes_value = bias2fes_scalingf*bias_rwgrid_pntr_->getValue(l);
-      if(log_reweight_grid_pntr_!=NULL){
-        fes_value += kBT()*log_reweight_grid_pntr_->getValue(l);
+  if(rw_lattice) {
+    // the constant coefficient already includes the shift
+    withoutcutoff_grid_pntr = shift_bias ? bias_withoutcutoff_rwgrid_pntr_ : NULL;
+    with_derivatives = bias_rwgrid_pntr_->hasDerivatives() || (withoutcutoff_grid_pntr!=NULL && withoutcutoff_grid_pntr->hasDerivatives());
+    contractBiasOnGrid(bias_rwgrid_pntr_,with_derivatives,bias,derivs,true);
+    sweepGridLattice(bias,derivs,0.0,false,bias_rwgrid_pntr_,withoutcutoff_grid_pntr,fes_rwgrid_pntr_,log_reweight_grid_pntr_,weights_pntr);
+  }
+  //
+  if(vesbias_pntr_!=NULL) {
+    vesbias_pntr_->setCurrentBiasMaxValue(shift_bias ? bias_max : bias_grid_pntr_->getMaxValue());
+  }
+  biasgrid_coeffs_version_ = getCoeffsVersion();
+  if(shift_bias) {biaswithoutcutoffgrid_coeffs_version_ = biasgrid_coeffs_version_;}
+  if(fes_grid_pntr_!=NULL) {
+    fesgrid_coeffs_version_ = biasgrid_coeffs_version_;
+    fesgrid_targetdist_version_ = targetdist_version_;
+  }
+}
+
+
+void LinearBasisSetExpansion::sweepGridLattice(const std::vector<double>& bias, const std::vector< std::vector<double> >& derivs, const double shift, const bool apply_cutoff, Grid* bias_pntr, Grid* bias_withoutcutoff_pntr, Grid* fes_pntr, const Grid* log_weights_pntr, const Grid* weights_pntr) {
+  bool has_derivatives = !derivs.empty();
+  std::vector<double> forces_point(nargs_,0.0);
+  std::vector<double> zeros(nargs_,0.0);
+  double bias2fes_scalingf = -1.0;
+  // running sums for the reweighting factor c(t), in the same way as in updateReweightingFactor()
+  double log_sumebv=-1.0e38;
+  double rw_norm=0.0;
+  double log_sumebf=-1.0e38;
+  double log_sumebfpv=-1.0e38;
+  for(Grid::index_t l=0; l<bias_pntr->getSize(); l++) {
+    double bias_point = bias[l]+shift;
+    if(has_derivatives) {
+      for(unsigned int k=0; k<nargs_; k++) {forces_point[k]=-derivs[k][l];}
+    }
+    if(bias_withoutcutoff_pntr!=NULL) {
+      if(bias_withoutcutoff_pntr->hasDerivatives()) {
+        bias_withoutcutoff_pntr->setValueAndDerivatives(l,bias_point,has_derivatives ? forces_point : zeros);
+      }
+      else {
+        bias_withoutcutoff_pntr->setValue(l,bias_point);
+      }
+    }
+    if(apply_cutoff) {
+      vesbias_pntr_->applyBiasCutoff(bias_point,forces_point);
+    }
+    if(bias_pntr->hasDerivatives()) {
+      bias_pntr->setValueAndDerivatives(l,bias_point,forces_point);
+    }
+    else {
+      bias_pntr->setValue(l,bias_point);
+    }
+    double fes_value = 0.0;
+    if(fes_pntr!=NULL) {
+      fes_value = bias2fes_scalingf*bias_point;
+      if(log_weights_pntr!=NULL) {
+        fes_value += kBT()*log_weights_pntr->getValue(l);
+      }
+      fes_pntr->setValue(l,fes_value);
+    }
+    if(weights_pntr!=NULL) {
+      double weight = weights_pntr->getValue(l);
+      if(weight>0) {
+        exp_added(log_sumebv,std::log(weight) + beta_*bias_point);
+        rw_norm += weight;
+      }
+      // the minimum of the FES is only set to zero below, which does not change
+      // the difference of the two sums
+      if(fes_pntr!=NULL) {
+        exp_added(log_sumebf,-1.0*beta_*fes_value);
+        exp_added(log_sumebfpv,-1.0*beta_*(fes_value+bias_point));
       }
-      fes_rwgrid_pntr_->setValue(l,fes_value);
     }
-    fes_rwgrid_pntr_->setMinToZero();
   }
-  //
-  if(action_pntr_!=NULL) {
-    setStepOfLastFesGridUpdate(action_pntr_->getStep());
+  if(fes_pntr!=NULL) {
+    fes_pntr->setMinToZero();
+  }
+  if(weights_pntr!=NULL) {
+    reweight_factor=(log_sumebv - std::log(rw_norm))/beta_;
+    reweight_factor_coeffs_version_ = getCoeffsVersion();
+    reweight_factor_targetdist_version_ = targetdist_version_;
+    if(fes_pntr!=NULL) {
+      reweight_factor_revised = (log_sumebf - log_sumebfpv)/beta_;
+      reweight_factor_revised_coeffs_version_ = getCoeffsVersion();
+      reweight_factor_revised_targetdist_version_ = targetdist_version_;
+    }
   }
 }
 
@@ -520,28 +1463,38 @@ void LinearBasisSetExpansion::writeTargetDistributionToFile(const std::string& f
 
 
 double LinearBasisSetExpansion::getBiasAndForces(const std::vector<double>& args_values, bool& all_inside, std::vector<double>& forces, std::vector<double>& coeffsderivs_values, std::vector<BasisFunctions*>& basisf_pntrs_in, CoeffsVector* coeffs_pntr_in, Communicator* comm_in) {
+  ExpansionWorkspace workspace(basisf_pntrs_in);
+  return getBiasAndForces(args_values,all_inside,forces,coeffsderivs_values,basisf_pntrs_in,coeffs_pntr_in,workspace,comm_in);
+}
+
+
+double LinearBasisSetExpansion::getBiasAndForces(const std::vector<double>& args_values, bool& all_inside, std::vector<double>& forces, std::vector<double>& coeffsderivs_values, std::vector<BasisFunctions*>& basisf_pntrs_in, CoeffsVector* coeffs_pntr_in, ExpansionWorkspace& workspace, Communicator* comm_in) {
   unsigned int nargs = args_values.size();
   plumed_assert(coeffs_pntr_in->numberOfDimensions()==nargs);
   plumed_assert(basisf_pntrs_in.size()==nargs);
   plumed_assert(forces.size()==nargs);
   plumed_assert(coeffsderivs_values.size()==coeffs_pntr_in->numberOfCoeffs());
+  plumed_assert(workspace.bf_values.size()==nargs);
+
+  getBasisFunctionValues(args_values,all_inside,basisf_pntrs_in,workspace);
+  return contractExpansion(workspace,coeffs_pntr_in,forces,&coeffsderivs_values,comm_in);
+}
 
-  std::vector<double> args_values_trsfrm(nargs);
-  // std::vector<bool>   inside_interval(nargs,true);
+
+void LinearBasisSetExpansion::getBasisFunctionValues(const std::vector<double>& args_values, bool& all_inside, std::vector<BasisFunctions*>& basisf_pntrs_in, ExpansionWorkspace& workspace) {
   all_inside = true;
-  //
-  std::vector< std::vector <double> > bf_values(nargs);
-  std::vector< std::vector <double> > bf_derivs(nargs);
-  //
-  for(unsigned int k=0; k<nargs; k++) {
-    bf_values[k].assign(basisf_pntrs_in[k]->getNumberOfBasisFunctions(),0.0);
-    bf_derivs[k].assign(basisf_pntrs_in[k]->getNumberOfBasisFunctions(),0.0);
+  for(unsigned int k=0; k<args_values.size(); k++) {
+    std::fill(workspace.bf_values[k].begin(),workspace.bf_values[k].end(),0.0);
+    std::fill(workspace.bf_derivs[k].begin(),workspace.bf_derivs[k].end(),0.0);
     bool curr_inside=true;
-    basisf_pntrs_in[k]->getAllValues(args_values[k],args_values_trsfrm[k],curr_inside,bf_values[k],bf_derivs[k]);
-    // inside_interval[k]=curr_inside;
+    basisf_pntrs_in[k]->getAllValues(args_values[k],workspace.args_values_trsfrm[k],curr_inside,workspace.bf_values[k],workspace.bf_derivs[k]);
     if(!curr_inside) {all_inside=false;}
-    forces[k]=0.0;
   }
+}
+
+
+double LinearBasisSetExpansion::contractExpansion(ExpansionWorkspace& workspace, const CoeffsVector* coeffs_pntr_in, std::vector<double>& forces, std::vector<double>* coeffsderivs_values, Communicator* comm_in) {
+  unsigned int nargs = workspace.bf_values.size();
   //
   size_t stride=1;
   size_t rank=0;
@@ -550,51 +1503,136 @@ double LinearBasisSetExpansion::getBiasAndForces(const std::vector<double>& args
     stride=comm_in->Get_size();
     rank=comm_in->Get_rank();
   }
-  // loop over coeffs
-  double bias=0.0;
-  for(size_t i=rank; i<coeffs_pntr_in->numberOfCoeffs(); i+=stride) {
-    std::vector<unsigned int> indices=coeffs_pntr_in->getIndices(i);
-    double coeff = coeffs_pntr_in->getValue(i);
-    double bf_curr=1.0;
-    for(unsigned int k=0; k<nargs; k++) {
-      bf_curr*=bf_values[k][indices[k]];
-    }
-    bias+=coeff*bf_curr;
-    coeffsderivs_values[i] = bf_curr;
-    for(unsigned int k=0; k<nargs; k++) {
-      double der = 1.0;
-      for(unsigned int l=0; l<nargs; l++) {
-        if(l!=k) {der*=bf_values[l][indices[l]];}
-        else {der*=bf_derivs[l][indices[l]];}
-      }
-      forces[k]-=coeff*der;
-      // maybe faster but dangerous
-      // forces[k]-=coeff*bf_curr*(bf_derivs[k][indices[k]]/bf_values[k][indices[k]]);
-    }
+  // contract the coefficient tensor one dimension at the time,
+  // each rank only takes into account a block of ncoeffs/stride coefficients
+  // for large expansions the fixed dimension kernels are also split over threads
+  unsigned int nthreads = 1;
+  size_t ncoeffs_rank = coeffs_pntr_in->numberOfCoeffs()/stride;
+  if(ncoeffs_rank>=2*min_coeffs_per_thread) {
+    nthreads = std::min<size_t>(OpenMP::getNumThreads(),ncoeffs_rank/min_coeffs_per_thread);
+  }
+  double bias;
+  switch(nargs) {
+  case 1: bias = contractCoeffsTensorFixed<1>(workspace,coeffs_pntr_in,&forces[0],rank,stride,nthreads); break;
+  case 2: bias = contractCoeffsTensorFixed<2>(workspace,coeffs_pntr_in,&forces[0],rank,stride,nthreads); break;
+  case 3: bias = contractCoeffsTensorFixed<3>(workspace,coeffs_pntr_in,&forces[0],rank,stride,nthreads); break;
+  default: bias = contractCoeffsTensor(workspace,coeffs_pntr_in,forces,rank,stride);
   }
+  // the basis set values are needed by all ranks, unless they are not wanted at all
+  if(coeffsderivs_values!=NULL) {getTensorProduct(workspace.bf_values,&(*coeffsderivs_values)[0]);}
   //
   if(comm_in!=NULL) {
     comm_in->Sum(bias);
     comm_in->Sum(forces);
   }
+  for(unsigned int k=0; k<nargs; k++) {
+    forces[k] = -forces[k];
+  }
   return bias;
 }
 
 
+double LinearBasisSetExpansion::contractCoeffsTensor(ExpansionWorkspace& workspace, const CoeffsVector* coeffs_pntr_in, std::vector<double>& bias_derivs, const size_t rank, const size_t stride) {
+  /*
+  The coefficients are stored as a dense tensor where the first dimension is
+  the fastest varying one, i.e. i = i_0 + n_0*(i_1 + n_1*(i_2 + ...)).
+  The tensor is contracted one dimension at the time. After the contraction of
+  dimensions 0,...,m-1 we keep the partial tensor obtained using only the values
+  of the basis functions (ptensor_val) and, for each k<m, the one where the
+  derivatives of the basis functions are used for dimension k (ptensor_der[k]).
+  Each contraction shrinks the partial tensors by a factor of n_m such that the
+  total cost is about 2*ncoeffs operations, independent of the number of
+  dimensions.
+  */
+  const RowKernels& kernels = rowKernels();
+  const std::vector< std::vector<double> >& bf_values = workspace.bf_values;
+  const std::vector< std::vector<double> >& bf_derivs = workspace.bf_derivs;
+  std::vector<double>& ptensor_val = workspace.ptensor_val;
+  std::vector< std::vector<double> >& ptensor_der = workspace.ptensor_der;
+  unsigned int ndim = bf_values.size();
+  size_t ncoeffs = coeffs_pntr_in->numberOfCoeffs();
+  const double* coeffs = &((*coeffs_pntr_in)[0]);
+  // first dimension, contracted directly against the coefficients,
+  // each rank takes a contiguous block of coefficients
+  size_t coeffs_begin = (rank*ncoeffs)/stride;
+  size_t coeffs_end = ((rank+1)*ncoeffs)/stride;
+  unsigned int nbf = bf_values[0].size();
+  size_t nrows = ncoeffs/nbf;
+  plumed_dbg_assert(ptensor_val.size()==nrows);
+  for(size_t j=0; j<nrows; j++) {
+    size_t begin = std::max(j*nbf,coeffs_begin);
+    size_t end = std::min((j+1)*nbf,coeffs_end);
+    if(begin<end) {
+      size_t i = begin-j*nbf;
+      kernels.dot2(coeffs+begin,&bf_values[0][i],&bf_derivs[0][i],end-begin,ptensor_val[j],ptensor_der[0][j]);
+    }
+    else {
+      ptensor_val[j] = 0.0;
+      ptensor_der[0][j] = 0.0;
+    }
+  }
+  // remaining dimensions, the partial tensors are contracted in place
+  for(unsigned int m=1; m<ndim; m++) {
+    nbf = bf_values[m].size();
+    nrows /= nbf;
+    for(size_t j=0; j<nrows; j++) {
+      size_t offset = j*nbf;
+      double sum_val = 0.0;
+      double sum_der = 0.0;
+      kernels.dot2(&ptensor_val[offset],&bf_values[m][0],&bf_derivs[m][0],nbf,sum_val,sum_der);
+      for(unsigned int k=0; k<m; k++) {
+        ptensor_der[k][j] = kernels.dot(&ptensor_der[k][offset],&bf_values[m][0],nbf);
+      }
+      ptensor_val[j] = sum_val;
+      ptensor_der[m][j] = sum_der;
+    }
+  }
+  plumed_dbg_assert(nrows==1);
+  for(unsigned int k=0; k<ndim; k++) {
+    bias_derivs[k] = ptensor_der[k][0];
+  }
+  return ptensor_val[0];
+}
+
+
+void LinearBasisSetExpansion::getTensorProduct(const std::vector< std::vector<double> >& bf_values, double* basisset_values) {
+  // built in place starting from the last (slowest varying) dimension,
+  // basisset_values[i_m + n_m*j] = f_m(i_m) * (product of the dimensions > m)[j]
+  const RowKernels& kernels = rowKernels();
+  unsigned int ndim = bf_values.size();
+  size_t size = bf_values[ndim-1].size();
+  std::copy(bf_values[ndim-1].begin(),bf_values[ndim-1].end(),basisset_values);
+  for(unsigned int m=ndim-1; m>0; m--) {
+    const std::vector<double>& values = bf_values[m-1];
+    unsigned int nbf = values.size();
+    for(size_t j=size; j>0; j--) {
+      double prod = basisset_values[j-1];
+      kernels.scale(&basisset_values[(j-1)*nbf],&values[0],prod,nbf);
+    }
+    size *= nbf;
+  }
+}
+
+
 void LinearBasisSetExpansion::getBasisSetValues(const std::vector<double>& args_values, std::vector<double>& basisset_values, std::vector<BasisFunctions*>& basisf_pntrs_in, CoeffsVector* coeffs_pntr_in, Communicator* comm_in) {
+  ExpansionWorkspace workspace(basisf_pntrs_in);
+  getBasisSetValues(args_values,basisset_values,basisf_pntrs_in,coeffs_pntr_in,workspace,comm_in);
+}
+
+
+void LinearBasisSetExpansion::getBasisSetValues(const std::vector<double>& args_values, std::vector<double>& basisset_values, std::vector<BasisFunctions*>& basisf_pntrs_in, CoeffsVector* coeffs_pntr_in, ExpansionWorkspace& workspace, Communicator* comm_in) {
   unsigned int nargs = args_values.size();
   plumed_assert(coeffs_pntr_in->numberOfDimensions()==nargs);
   plumed_assert(basisf_pntrs_in.size()==nargs);
+  plumed_assert(workspace.bf_values.size()==nargs);
 
-  std::vector<double> args_values_trsfrm(nargs);
-  std::vector< std::vector <double> > bf_values;
+  std::vector< std::vector<double> >& bf_values = workspace.bf_values;
   //
   for(unsigned int k=0; k<nargs; k++) {
-    std::vector<double> tmp_val(basisf_pntrs_in[k]->getNumberOfBasisFunctions());
-    std::vector<double> tmp_der(tmp_val.size());
+    std::fill(bf_values[k].begin(),bf_values[k].end(),0.0);
+    std::fill(workspace.bf_derivs[k].begin(),workspace.bf_derivs[k].end(),0.0);
     bool inside=true;
-    basisf_pntrs_in[k]->getAllValues(args_values[k],args_values_trsfrm[k],inside,tmp_val,tmp_der);
-    bf_values.push_back(tmp_val);
+    basisf_pntrs_in[k]->getAllValues(args_values[k],workspace.args_values_trsfrm[k],inside,bf_values[k],workspace.bf_derivs[k]);
   }
   //
   size_t stride=1;
@@ -604,14 +1642,24 @@ void LinearBasisSetExpansion::getBasisSetValues(const std::vector<double>& args_
     stride=comm_in->Get_size();
     rank=comm_in->Get_rank();
   }
+  // in serial the full product is built directly
+  if(stride==1) {
+    getTensorProduct(bf_values,&basisset_values[0]);
+    return;
+  }
+  std::fill(basisset_values.begin(),basisset_values.end(),0.0);
   // loop over basis set
-  for(size_t i=rank; i<coeffs_pntr_in->numberOfCoeffs(); i+=stride) {
-    std::vector<unsigned int> indices=coeffs_pntr_in->getIndices(i);
-    double bf_curr=1.0;
-    for(unsigned int k=0; k<nargs; k++) {
-      bf_curr*=bf_values[k][indices[k]];
+  size_t ncoeffs = coeffs_pntr_in->numberOfCoeffs();
+  plumed_dbg_assert(workspace.coeffs_indices[0].size()==ncoeffs);
+  for(size_t i=rank; i<ncoeffs; i+=stride) {
+    basisset_values[i] = bf_values[0][workspace.coeffs_indices[0][i]];
+  }
+  for(unsigned int k=1; k<nargs; k++) {
+    const std::vector<unsigned short>& indices = workspace.coeffs_indices[k];
+    const std::vector<double>& values = bf_values[k];
+    for(size_t i=rank; i<ncoeffs; i+=stride) {
+      basisset_values[i] *= values[indices[i]];
     }
-    basisset_values[i] = bf_curr;
   }
   //
   if(comm_in!=NULL) {
@@ -620,6 +1668,86 @@ void LinearBasisSetExpansion::getBasisSetValues(const std::vector<double>& args_
 }
 
 
+void LinearBasisSetExpansion::addBasisSetValuesBatch(const std::vector< std::vector<double> >& args_values, const std::vector<double>& weights, std::vector<double>& sums, std::vector<BasisFunctions*>& basisf_pntrs_in, ExpansionWorkspace& workspace) {
+  /*
+  The sums are the product of the weighted values of the basis functions of
+  the first dimension, a nbf0 x npoints matrix, and the tensor product of the
+  values of the other dimensions, a npoints x nrest matrix, where the points
+  are the contiguous index of both. The tensor product is built one dimension
+  at a time for all the points, with the second dimension running fastest as
+  in the coefficients.
+  */
+  unsigned int nargs = args_values.size();
+  plumed_assert(basisf_pntrs_in.size()==nargs);
+  size_t npoints = args_values[0].size();
+  plumed_massert(weights.size()==npoints,"a weight should be given for each point");
+  if(npoints==0) {return;}
+  getBasisFunctionsBatch(args_values,basisf_pntrs_in,workspace);
+  const std::vector< std::vector<double> >& bf_values = workspace.batch_bf_values;
+  std::vector<double>* rest = &workspace.batch_products[0];
+  std::vector<double>* next = &workspace.batch_products[1];
+  rest->assign(npoints,1.0);
+  size_t nrest = 1;
+  for(unsigned int k=1; k<nargs; k++) {
+    size_t nbf = workspace.bf_values[k].size();
+    next->resize(nrest*nbf*npoints);
+    for(size_t j=0; j<nbf; j++) {
+      const double* v = &bf_values[k][j*npoints];
+      for(size_t r=0; r<nrest; r++) {
+        const double* in = &(*rest)[r*npoints];
+        double* out = &(*next)[(r+nrest*j)*npoints];
+        for(size_t p=0; p<npoints; p++) {out[p] = in[p]*v[p];}
+      }
+    }
+    std::swap(rest,next);
+    nrest *= nbf;
+  }
+  size_t nbf0 = workspace.bf_values[0].size();
+  plumed_massert(sums.size()==nbf0*nrest,"the size of the sums does not match the number of coefficients");
+  std::vector<double>& weighted = workspace.batch_weighted;
+  weighted.resize(nbf0*npoints);
+  for(size_t i=0; i<nbf0; i++) {
+    const double* v = &bf_values[0][i*npoints];
+    double* out = &weighted[i*npoints];
+    for(size_t p=0; p<npoints; p++) {out[p] = weights[p]*v[p];}
+  }
+  //
+  const RowKernels& kernels = rowKernels();
+  unsigned int nthreads = 1;
+  if(sums.size()>=2*min_coeffs_per_thread) {
+    nthreads = std::min<size_t>(OpenMP::getNumThreads(),sums.size()/min_coeffs_per_thread);
+  }
+  const std::vector<double>& products = *rest;
+  #pragma omp parallel for num_threads(nthreads)
+  for(size_t r=0; r<nrest; r++) {
+    const double* b = &products[r*npoints];
+    for(size_t i=0; i<nbf0; i++) {
+      sums[i+nbf0*r] += kernels.dot(&weighted[i*npoints],b,npoints);
+    }
+  }
+}
+
+
+void LinearBasisSetExpansion::getBasisFunctionsBatch(const std::vector< std::vector<double> >& args_values, std::vector<BasisFunctions*>& basisf_pntrs_in, ExpansionWorkspace& workspace) {
+  // the tables are stored as bf_values[k][i*npoints+p]
+  std::vector< std::vector<double> >& bf_values = workspace.batch_bf_values;
+  size_t npoints = args_values[0].size();
+  for(unsigned int k=0; k<args_values.size(); k++) {
+    size_t nbf = workspace.bf_values[k].size();
+    bf_values[k].resize(nbf*npoints);
+    for(size_t p=0; p<npoints; p++) {
+      bool curr_inside=true;
+      std::fill(workspace.bf_values[k].begin(),workspace.bf_values[k].end(),0.0);
+      std::fill(workspace.bf_derivs[k].begin(),workspace.bf_derivs[k].end(),0.0);
+      basisf_pntrs_in[k]->getAllValues(args_values[k][p],workspace.args_values_trsfrm[k],curr_inside,workspace.bf_values[k],workspace.bf_derivs[k]);
+      for(size_t i=0; i<nbf; i++) {
+        bf_values[k][i*npoints+p] = workspace.bf_values[k][i];
+      }
+    }
+  }
+}
+
+
 void LinearBasisSetExpansion::setupUniformTargetDistribution() {
   std::vector< std::vector <double> > bf_integrals(0);
   std::vector<double> targetdist_averages(ncoeffs_,0.0);
@@ -628,13 +1756,12 @@ void LinearBasisSetExpansion::setupUniformTargetDistribution() {
     bf_integrals.push_back(basisf_pntrs_[k]->getUniformIntegrals());
   }
   //
-  for(size_t i=0; i<ncoeffs_; i++) {
-    std::vector<unsigned int> indices=bias_coeffs_pntr_->getIndices(i);
-    double value = 1.0;
-    for(unsigned int k=0; k<nargs_; k++) {
-      value*=bf_integrals[k][indices[k]];
+  std::fill(targetdist_averages.begin(),targetdist_averages.end(),1.0);
+  for(unsigned int k=0; k<nargs_; k++) {
+    const std::vector<unsigned short>& indices = workspace_.coeffs_indices[k];
+    for(size_t i=0; i<ncoeffs_; i++) {
+      targetdist_averages[i]*=bf_integrals[k][indices[i]];
     }
-    targetdist_averages[i]=value;
   }
   TargetDistAverages() = targetdist_averages;
 }
@@ -691,16 +1818,24 @@ void LinearBasisSetExpansion::setupTargetDistribution(TargetDistribution* target
 void LinearBasisSetExpansion::updateTargetDistribution() {
   plumed_massert(targetdist_pntr_!=NULL,"the target distribution hasn't been setup!");
   plumed_massert(targetdist_pntr_->isDynamic(),"this should only be used for dynamically updated target distributions!");
-  if(targetdist_pntr_->biasGridNeeded()) {updateBiasGrid();}
+  // a dynamic target distribution only depends on the bias or the FES
+  if(targetdist_coeffs_version_==getCoeffsVersion()) {return;}
+  // the shift of the bias without cutoff is done first such that all the
+  // grids are obtained from the same sweep
   if(biasCutoffActive()) {updateBiasWithoutCutoffGrid();}
+  if(targetdist_pntr_->biasGridNeeded()) {updateBiasGrid();}
   if(targetdist_pntr_->fesGridNeeded()) {updateFesGrid();}
   targetdist_pntr_->updateTargetDist();
+  // the FES and the reweighting factor depend on the target distribution
+  targetdist_version_++;
+  targetdist_coeffs_version_ = getCoeffsVersion();
   calculateTargetDistAveragesFromGrid(targetdist_grid_pntr_);
 }
 
 
 void LinearBasisSetExpansion::readInRestartTargetDistribution(const std::string& grid_fname) {
   targetdist_pntr_->readInRestartTargetDistGrid(grid_fname);
+  targetdist_version_++;
   if(biasCutoffActive()) {
     targetdist_pntr_->clearLogTargetDistGrid();
     // Added by Y. Isaac Yang to calculate the reweighting factor
@@ -723,16 +1858,25 @@ void LinearBasisSetExpansion::calculateTargetDistAveragesFromGrid(const Grid* ta
   plumed_assert(targetdist_grid_pntr!=NULL);
   std::vector<double> targetdist_averages(ncoeffs_,0.0);
   std::vector<double> integration_weights = GridIntegrationWeights::getIntegrationWeights(targetdist_grid_pntr);
+  // each rank takes a contiguous range of grid points, evaluated in blocks
   Grid::index_t stride=mycomm_.Get_size();
   Grid::index_t rank=mycomm_.Get_rank();
-  for(Grid::index_t l=rank; l<targetdist_grid_pntr->getSize(); l+=stride) {
-    std::vector<double> args_values = targetdist_grid_pntr->getPoint(l);
-    std::vector<double> basisset_values(ncoeffs_);
-    getBasisSetValues(args_values,basisset_values,false);
-    double weight = integration_weights[l]*targetdist_grid_pntr->getValue(l);
-    for(unsigned int i=0; i<ncoeffs_; i++) {
-      targetdist_averages[i] += weight*basisset_values[i];
+  Grid::index_t points_begin = (rank*targetdist_grid_pntr->getSize())/stride;
+  Grid::index_t points_end = ((rank+1)*targetdist_grid_pntr->getSize())/stride;
+  // the memory of the tensor product of the dimensions after the first one is kept within the cache size
+  const Grid::index_t block = std::max<Grid::index_t>(64,batch_cache_size/(ncoeffs_/nbasisf_[0]));
+  std::vector< std::vector<double> > args_values(nargs_);
+  std::vector<double> weights;
+  for(Grid::index_t l0=points_begin; l0<points_end; l0+=block) {
+    Grid::index_t npoints = std::min(block,points_end-l0);
+    for(unsigned int k=0; k<nargs_; k++) {args_values[k].resize(npoints);}
+    weights.resize(npoints);
+    for(Grid::index_t p=0; p<npoints; p++) {
+      std::vector<double> point = targetdist_grid_pntr->getPoint(l0+p);
+      for(unsigned int k=0; k<nargs_; k++) {args_values[k][p]=point[k];}
+      weights[p] = integration_weights[l0+p]*targetdist_grid_pntr->getValue(l0+p);
     }
+    addBasisSetValuesBatch(args_values,weights,targetdist_averages,basisf_pntrs_,batch_workspace_);
   }
   mycomm_.Sum(targetdist_averages);
   // the overall constant;
@@ -791,10 +1935,17 @@ void LinearBasisSetExpansion::updateReweightingFactor(const Grid* grid_pntr,cons
   reweight_factor=(log_sumebv - std::log(rw_norm))/beta_;
 }
 void LinearBasisSetExpansion::updateReweightingFactor() {
+  // the bias grids are brought up to date first, the sweep over them then
+  // also gives the factor unless the weights are not defined at that point
+  if(!reweight_factor_active_) {return;}
+  if(bias_grid_pntr_!=NULL) {updateBiasGrid();}
+  if(reweight_factor_coeffs_version_==getCoeffsVersion() && reweight_factor_targetdist_version_==targetdist_version_) {return;}
   if(isReweightGridActive())
     updateReweightingFactor(reweight_grid_pntr_,bias_rwgrid_pntr_);
   else
     updateReweightingFactor(targetdist_grid_pntr_,bias_grid_pntr_);
+  reweight_factor_coeffs_version_ = getCoeffsVersion();
+  reweight_factor_targetdist_version_ = targetdist_version_;
 }
 
 void LinearBasisSetExpansion::updateReweightingFactorRevised(const Grid* fes_pntr,const Grid* bias_pntr) {
@@ -836,10 +1987,15 @@ void LinearBasisSetExpansion::updateReweightingFactorRevised(const Grid* fes_pnt
 }
 
 void LinearBasisSetExpansion::updateReweightingFactorRevised() {
+  if(!reweight_factor_active_) {return;}
+  if(fes_grid_pntr_!=NULL) {updateFesGrid();}
+  if(reweight_factor_revised_coeffs_version_==getCoeffsVersion() && reweight_factor_revised_targetdist_version_==targetdist_version_) {return;}
   if(isReweightGridActive())
     updateReweightingFactorRevised(fes_rwgrid_pntr_,bias_rwgrid_pntr_);
   else
     updateReweightingFactorRevised(fes_grid_pntr_,bias_grid_pntr_);
+  reweight_factor_revised_coeffs_version_ = getCoeffsVersion();
+  reweight_factor_revised_targetdist_version_ = targetdist_version_;
 }
 //
 
@@ -848,6 +2004,7 @@ void LinearBasisSetExpansion::setBiasMinimumToZero() {
   plumed_massert(bias_grid_pntr_!=NULL,"setBiasMinimumToZero can only be used if the bias grid is defined");
   updateBiasGrid();
   BiasCoeffs()[0]-=bias_grid_pntr_->getMinValue();
+  increaseCoeffsVersion();
 }
 
 
@@ -855,6 +2012,7 @@ void LinearBasisSetExpansion::setBiasMaximumToZero() {
   plumed_massert(bias_grid_pntr_!=NULL,"setBiasMaximumToZero can only be used if the bias grid is defined");
   updateBiasGrid();
   BiasCoeffs()[0]-=bias_grid_pntr_->getMaxValue();
+  increaseCoeffsVersion();
 }
 
 
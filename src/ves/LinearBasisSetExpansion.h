@@ -24,6 +24,7 @@
 
 #include <vector>
 #include <string>
+#include <map>
 
 
 namespace PLMD {
@@ -44,6 +45,70 @@ class TargetDistribution;
 class VesBias;
 
 
+/*
+Buffers needed when evaluating a linear basis set expansion. They are sized
+once for a given set of basis functions such that evaluating the expansion
+does not require any memory allocation. The multi-indices of all the
+coefficients are stored as one array per dimension, coeffs_indices[k][i]
+being the index of the basis function in dimension k for coefficient i.
+For localized basis functions, support[k] holds the indices of the basis
+functions in dimension k that are non-zero at the current point. When
+summing over many points, batch_bf_values[k][i*npoints+p] holds the values
+of the basis functions at all the points and batch_products the partial
+tensor products over the points, they are only reallocated when the number
+of points grows.
+*/
+class ExpansionWorkspace {
+public:
+  std::vector< std::vector<unsigned short> > coeffs_indices;
+  std::vector<size_t> coeffs_strides;
+  std::vector<double> args_values_trsfrm;
+  std::vector< std::vector<double> > bf_values;
+  std::vector< std::vector<double> > bf_derivs;
+  std::vector<double> ptensor_val;
+  std::vector< std::vector<double> > ptensor_der;
+  std::vector<double> forces;
+  std::vector<double> basisset_values;
+  std::vector<double> partial_products;
+  std::vector< std::vector<unsigned int> > support;
+  std::vector<unsigned int> support_pos;
+  std::vector<size_t> support_coeffs;
+  std::vector< std::vector<double> > batch_bf_values;
+  std::vector< std::vector<double> > batch_products;
+  std::vector<double> batch_weighted;
+public:
+  ExpansionWorkspace() {}
+  explicit ExpansionWorkspace(const std::vector<BasisFunctions*>&);
+  void resize(const std::vector<BasisFunctions*>&);
+};
+
+
+/*
+Values and derivatives of the basis functions at the grid points along each
+dimension of a grid, element (p,j) of table k is at p*nbf_k+j for grid point
+p and basis function j. They only depend on the geometry of the grid.
+*/
+class GridBasisTables {
+public:
+  std::vector<unsigned int> npoints;
+  std::vector< std::vector<double> > values;
+  std::vector< std::vector<double> > derivs;
+};
+
+
+// raw bias on a grid and the coefficients it was obtained with, used to
+// update the grid from the change of the coefficients
+class GridBiasCache {
+public:
+  bool with_derivatives;
+  unsigned int ndelta_updates;
+  std::vector<double> coeffs;
+  std::vector<double> bias;
+  std::vector< std::vector<double> > derivs;
+  GridBiasCache(): with_derivatives(false), ndelta_updates(0) {}
+};
+
+
 class LinearBasisSetExpansion {
 private:
   std::string label_;
@@ -72,20 +137,45 @@ private:
   //
   std::string targetdist_grid_label_;
   //
-  long int step_of_last_biasgrid_update;
-  long int step_of_last_biaswithoutcutoffgrid_update;
-  long int step_of_last_fesgrid_update;
+  // the grids are only updated if the versions of the coefficients or of the
+  // target distribution they were obtained with are not the current ones
+  unsigned long int coeffs_version_;
+  unsigned long int targetdist_version_;
+  unsigned long int biasgrid_coeffs_version_;
+  unsigned long int biaswithoutcutoffgrid_coeffs_version_;
+  unsigned long int fesgrid_coeffs_version_;
+  unsigned long int fesgrid_targetdist_version_;
+  unsigned long int targetdist_coeffs_version_;
   //
   Grid* bias_grid_pntr_;
   Grid* bias_withoutcutoff_grid_pntr_;
   Grid* fes_grid_pntr_;
+  Grid* bias_interp_grid_pntr_;
   Grid* log_targetdist_grid_pntr_;
   Grid* targetdist_grid_pntr_;
   //
   TargetDistribution* targetdist_pntr_;
+  //
+  ExpansionWorkspace workspace_;
+  // separate workspace for the sums over many points, such that the values in workspace_ are kept
+  ExpansionWorkspace batch_workspace_;
+  // tables of the basis functions for each of the grids that are filled
+  std::map<const Grid*,GridBasisTables> grid_basis_tables_;
+  // the bias grids are updated from the coefficients that changed more than this tolerance
+  std::map<const Grid*,GridBiasCache> grid_bias_cache_;
+  double grid_delta_tolerance_;
+  // coefficients used in the sparse evaluation
+  bool sparse_evaluation_;
+  std::vector<size_t> active_coeffs_;
   // Added by Y. Isaac Yang to calculate the reweighting factor
+  bool reweight_factor_active_;
   double reweight_factor;
   double reweight_factor_revised;
+  // versions of the coefficients and of the target distribution the factors were obtained with
+  unsigned long int reweight_factor_coeffs_version_;
+  unsigned long int reweight_factor_targetdist_version_;
+  unsigned long int reweight_factor_revised_coeffs_version_;
+  unsigned long int reweight_factor_revised_targetdist_version_;
   std::vector<std::string> reweight_min_;
   std::vector<std::string> reweight_max_;
   std::vector<unsigned int> reweight_bins_;
@@ -124,41 +214,70 @@ public:
   CoeffsVector& BiasCoeffs() const {return *bias_coeffs_pntr_;};
   CoeffsVector& TargetDistAverages() const {return *targetdist_averages_pntr_;};
   //
+  // in serial mode each rank evaluates the full expansion without communication
   void setSerial() {serial_=true;}
   void setParallel() {serial_=false;}
+  bool isSerial() const {return serial_;}
   //
   void linkVesBias(VesBias*);
   void linkAction(Action*);
   // calculate bias and derivatives
   static double getBiasAndForces(const std::vector<double>&, bool&, std::vector<double>&, std::vector<double>&, std::vector<BasisFunctions*>&, CoeffsVector*, Communicator* comm_in=NULL);
+  static double getBiasAndForces(const std::vector<double>&, bool&, std::vector<double>&, std::vector<double>&, std::vector<BasisFunctions*>&, CoeffsVector*, ExpansionWorkspace&, Communicator* comm_in=NULL);
   double getBiasAndForces(const std::vector<double>&, bool&, std::vector<double>&, std::vector<double>&);
   double getBiasAndForces(const std::vector<double>&, bool&, std::vector<double>&);
+  // only takes into account the basis functions that are non-zero at the given point,
+  // the coefficients for which coeffsderivs_values is written are returned in the last argument
+  double getBiasAndForces(const std::vector<double>&, bool&, std::vector<double>&, std::vector<double>&, std::vector<size_t>&);
+  // bias and forces without the basis set values, which are left as the values
+  // of the basis functions in each dimension (see getBasisFunctionValuesInWorkspace())
+  double getBiasAndForcesWithoutBasisSetValues(const std::vector<double>&, bool&, std::vector<double>&);
+  const std::vector< std::vector<double> >& getBasisFunctionValuesInWorkspace() const {return workspace_.bf_values;}
   double getBias(const std::vector<double>&, bool&, const bool parallel=true);
   //
   static void getBasisSetValues(const std::vector<double>&, std::vector<double>&, std::vector<BasisFunctions*>&, CoeffsVector*, Communicator* comm_in=NULL);
+  static void getBasisSetValues(const std::vector<double>&, std::vector<double>&, std::vector<BasisFunctions*>&, CoeffsVector*, ExpansionWorkspace&, Communicator* comm_in=NULL);
   void getBasisSetValues(const std::vector<double>&, std::vector<double>&, const bool parallel=true);
+  // weighted sums of the basis set values over many points given as args_values[k][p]
+  // for argument k and point p, sums[i] += sum_p weights[p]*F_i(p)
+  static void addBasisSetValuesBatch(const std::vector< std::vector<double> >&, const std::vector<double>&, std::vector<double>&, std::vector<BasisFunctions*>&, ExpansionWorkspace&);
+  // sparse evaluation where only the given coefficients are taken into account
+  void setupSparseEvaluation(const std::vector<size_t>&);
+  void disableSparseEvaluation();
+  bool sparseEvaluationActive() const {return sparse_evaluation_;}
+  const std::vector<size_t>& getActiveCoeffs() const {return active_coeffs_;}
+  double getBiasAndForcesSparse(const std::vector<double>&, bool&, std::vector<double>&, std::vector<double>&);
+  // instruction set used by the kernels that evaluate the expansion
+  static std::string getKernelsName();
+  // if evaluating all coefficients on each rank is faster than splitting them
+  static bool replicatedEvaluationPreferred(const size_t, const unsigned int, const double);
+  static double getDefaultEvaluationCrossover() {return 10000.0;}
+  // version of the coefficients, taken from the VesBias if linked
+  unsigned long int getCoeffsVersion() const;
+  void increaseCoeffsVersion();
   // Bias grid and output stuff
+  void setGridDeltaTolerance(const double tolerance) {grid_delta_tolerance_=tolerance;}
+  double getGridDeltaTolerance() const {return grid_delta_tolerance_;}
   void setupBiasGrid(const bool usederiv=false);
   void updateBiasGrid();
-  void resetStepOfLastBiasGridUpdate() {step_of_last_biasgrid_update = -1000;}
-  void setStepOfLastBiasGridUpdate(long int step) {step_of_last_biasgrid_update = step;}
-  long int getStepOfLastBiasGridUpdate() const {return step_of_last_biasgrid_update;}
+  void invalidateBiasGrid() {biasgrid_coeffs_version_ = 0;}
   void writeBiasGridToFile(OFile&, const bool append=false) const;
   //
   void updateBiasWithoutCutoffGrid();
-  void resetStepOfLastBiasWithoutCutoffGridUpdate() {step_of_last_biaswithoutcutoffgrid_update = -1000;}
-  void setStepOfLastBiasWithoutCutoffGridUpdate(long int step) {step_of_last_biaswithoutcutoffgrid_update = step;}
-  long int getStepOfLastBiasWithoutCutoffGridUpdate() const {return step_of_last_biaswithoutcutoffgrid_update;}
+  void invalidateBiasWithoutCutoffGrid() {biaswithoutcutoffgrid_coeffs_version_ = 0;}
   void writeBiasWithoutCutoffGridToFile(OFile&, const bool append=false) const;
   //
   void setBiasMinimumToZero();
   void setBiasMaximumToZero();
+  // static bias obtained by spline interpolation from a grid
+  void setupBiasInterpolation(const std::vector<unsigned int>&);
+  bool biasInterpolationActive() const {return bias_interp_grid_pntr_!=NULL;}
+  double getBiasAndForcesFromGrid(const std::vector<double>&, bool&, std::vector<double>&);
+  void getBiasInterpolationError(double&, double&, double&);
   //
   void setupFesGrid();
   void updateFesGrid();
-  void resetStepOfLastFesGridUpdate() {step_of_last_fesgrid_update = -1000;}
-  void setStepOfLastFesGridUpdate(long int step) {step_of_last_fesgrid_update = step;}
-  long int getStepOfLastFesGridUpdate() const {return step_of_last_fesgrid_update;}
+  void invalidateFesGrid() {fesgrid_coeffs_version_ = 0;}
   void writeFesGridToFile(OFile&, const bool append=false) const;
   //
   void setupFesProjGrid();
@@ -196,6 +315,9 @@ public:
   void writeLogReweightGridToFile(OFile&, const bool append=false) const;
   bool isReweightGridActive() const {return reweight_grid_active_;}
   void setReweightGrid(const std::vector<unsigned int>&,const std::vector<std::string>&,const std::vector<std::string>&);
+  // the grids are only refreshed for c(t) and its sums accumulated if enabled
+  void enableReweightingFactor() {reweight_factor_active_=true;}
+  bool reweightingFactorActive() const {return reweight_factor_active_;}
   double getReweightFactor() const {return reweight_factor;}
   double getReweightFactorRevised() const {return reweight_factor_revised;}
   void updateReweightingFactor(const Grid*,const Grid*);
@@ -209,6 +331,25 @@ private:
   //
   void calculateTargetDistAveragesFromGrid(const Grid*);
   //
+  static void getBasisFunctionValues(const std::vector<double>&, bool&, std::vector<BasisFunctions*>&, ExpansionWorkspace&);
+  static double contractExpansion(ExpansionWorkspace&, const CoeffsVector*, std::vector<double>&, std::vector<double>*, Communicator*);
+  size_t findSupport();
+  void enumerateSupport(std::vector<size_t>&, std::vector<double>*);
+  double contractCoeffsList(const std::vector<size_t>&, std::vector<double>&);
+  static double contractCoeffsTensor(ExpansionWorkspace&, const CoeffsVector*, std::vector<double>&, const size_t rank=0, const size_t stride=1);
+  static void getTensorProduct(const std::vector< std::vector<double> >&, double*);
+  static void getBasisFunctionsBatch(const std::vector< std::vector<double> >&, std::vector<BasisFunctions*>&, ExpansionWorkspace&);
+  //
+  void contractBiasOnGrid(const Grid*, const bool, std::vector<double>&, std::vector< std::vector<double> >&, const bool delta_update=false);
+  bool updateBiasOnGridFromDelta(const Grid*, const bool, GridBiasCache&);
+  void addCoeffsDeltaOnGrid(const std::vector<const std::vector<double>*>&, const std::vector<unsigned int>&, const std::vector<size_t>&, const std::vector<double>&, std::vector<double>&) const;
+  void fillBiasGrid(Grid*, const bool, const bool bias_derivatives=false);
+  void fillFesGridFromBiasGrid(Grid*, const Grid*, const Grid*);
+  void sweepGrids(const bool);
+  void sweepGridLattice(const std::vector<double>&, const std::vector< std::vector<double> >&, const double, const bool, Grid*, Grid*, Grid*, const Grid*, const Grid*);
+  const GridBasisTables& getGridBasisTables(const Grid*);
+  void contractCoeffsOnGrid(const std::vector<const std::vector<double>*>&, const std::vector<unsigned int>&, const unsigned int, const unsigned int, std::vector<double>&) const;
+  //
   bool isStaticTargetDistFileOutputActive() const;
   // Added by Y. Isaac Yang to calculate the reweighting factor
   Grid* setupGeneralGrid(const std::string&, const std::vector<std::string>&,const std::vector<std::string>&, const std::vector<unsigned int>&, const bool usederiv=false);
@@ -218,37 +359,37 @@ private:
 
 inline
 double LinearBasisSetExpansion::getBiasAndForces(const std::vector<double>& args_values, bool& all_inside, std::vector<double>& forces, std::vector<double>& coeffsderivs_values) {
-  return getBiasAndForces(args_values,all_inside,forces,coeffsderivs_values,basisf_pntrs_, bias_coeffs_pntr_, &mycomm_);
+  if(sparse_evaluation_) {
+    return getBiasAndForcesSparse(args_values,all_inside,forces,coeffsderivs_values);
+  }
+  return getBiasAndForces(args_values,all_inside,forces,coeffsderivs_values,basisf_pntrs_, bias_coeffs_pntr_, workspace_, serial_ ? NULL : &mycomm_);
 }
 
 
 inline
 double LinearBasisSetExpansion::getBiasAndForces(const std::vector<double>& args_values, bool& all_inside, std::vector<double>& forces) {
-  std::vector<double> coeffsderivs_values_dummy(ncoeffs_);
-  return getBiasAndForces(args_values,all_inside,forces,coeffsderivs_values_dummy,basisf_pntrs_, bias_coeffs_pntr_, &mycomm_);
+  return getBiasAndForces(args_values,all_inside,forces,workspace_.basisset_values,basisf_pntrs_, bias_coeffs_pntr_, workspace_, serial_ ? NULL : &mycomm_);
 }
 
 
 inline
 double LinearBasisSetExpansion::getBias(const std::vector<double>& args_values, bool& all_inside, const bool parallel) {
-  std::vector<double> forces_dummy(nargs_);
-  std::vector<double> coeffsderivs_values_dummy(ncoeffs_);
-  if(parallel) {
-    return getBiasAndForces(args_values,all_inside,forces_dummy,coeffsderivs_values_dummy,basisf_pntrs_, bias_coeffs_pntr_, &mycomm_);
+  if(parallel && !serial_) {
+    return getBiasAndForces(args_values,all_inside,workspace_.forces,workspace_.basisset_values,basisf_pntrs_, bias_coeffs_pntr_, workspace_, &mycomm_);
   }
   else {
-    return getBiasAndForces(args_values,all_inside,forces_dummy,coeffsderivs_values_dummy,basisf_pntrs_, bias_coeffs_pntr_, NULL);
+    return getBiasAndForces(args_values,all_inside,workspace_.forces,workspace_.basisset_values,basisf_pntrs_, bias_coeffs_pntr_, workspace_, NULL);
   }
 }
 
 
 inline
 void LinearBasisSetExpansion::getBasisSetValues(const std::vector<double>& args_values, std::vector<double>& basisset_values, const bool parallel) {
-  if(parallel) {
-    getBasisSetValues(args_values,basisset_values,basisf_pntrs_, bias_coeffs_pntr_, &mycomm_);
+  if(parallel && !serial_) {
+    getBasisSetValues(args_values,basisset_values,basisf_pntrs_, bias_coeffs_pntr_, workspace_, &mycomm_);
   }
   else {
-    getBasisSetValues(args_values,basisset_values,basisf_pntrs_, bias_coeffs_pntr_, NULL);
+    getBasisSetValues(args_values,basisset_values,basisf_pntrs_, bias_coeffs_pntr_, workspace_, NULL);
   }
 }
 
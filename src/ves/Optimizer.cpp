@@ -199,6 +199,19 @@ Optimizer::Optimizer(const ActionOptions&ao):
     parseFlag("FULL_HESSIAN",full_hessian);
     diagonal_hessian_ = !full_hessian;
   }
+  if(keywords.exists("HESSIAN_BUFFER_SIZE")) {
+    unsigned int hessian_buffer_size = 0;
+    parse("HESSIAN_BUFFER_SIZE",hessian_buffer_size);
+    if(hessian_buffer_size>0) {
+      if(diagonal_hessian_) {
+        plumed_merror(getName()+": HESSIAN_BUFFER_SIZE can only be used with FULL_HESSIAN");
+      }
+      for(unsigned int i=0; i<nbiases_; i++) {
+        bias_pntrs_[i]->setHessianBufferSize(hessian_buffer_size);
+      }
+      log.printf("  off-diagonal part of the Hessian updated every %u samples using buffered samples\n",hessian_buffer_size);
+    }
+  }
   //
   bool mw_single_files = false;
   if(keywords.exists("MULTIPLE_WALKERS")) {
@@ -207,6 +220,68 @@ Optimizer::Optimizer(const ActionOptions&ao):
       mw_single_files=true;
     }
   }
+  if(keywords.exists("WALKERS_DIRECTORY")) {
+    std::string walkers_directory = "";
+    parse("WALKERS_DIRECTORY",walkers_directory);
+    if(walkers_directory.size()>0) {
+      if(use_mwalkers_mpi_) {
+        plumed_merror(getName()+": WALKERS_DIRECTORY cannot be used together with MULTIPLE_WALKERS");
+      }
+      std::string walker_id = "";
+      parse("WALKER_ID",walker_id);
+      if(walker_id.size()==0) {
+        plumed_merror(getName()+": WALKER_ID is needed when using WALKERS_DIRECTORY");
+      }
+      for(unsigned int i=0; i<nbiases_; i++) {
+        bias_pntrs_[i]->setWalkersDirectory(walkers_directory,walker_id);
+      }
+      log.printf("  walker %s exchanges the averages with other walkers through the directory %s\n",walker_id.c_str(),walkers_directory.c_str());
+    }
+  }
+  for(unsigned int i=0; i<nbiases_; i++) {
+    if(getStride()%bias_pntrs_[i]->getAveragingStride()!=0) {
+      plumed_merror(getName()+": the STRIDE of the optimizer should be a multiple of the AVERAGING_STRIDE of bias "+bias_pntrs_[i]->getLabel());
+    }
+  }
+  bool mw_single_precision = false;
+  if(keywords.exists("MULTIPLE_WALKERS_SINGLE_PRECISION")) {
+    parseFlag("MULTIPLE_WALKERS_SINGLE_PRECISION",mw_single_precision);
+    if(mw_single_precision && !use_mwalkers_mpi_) {
+      plumed_merror(getName()+": MULTIPLE_WALKERS_SINGLE_PRECISION can only be used together with MULTIPLE_WALKERS");
+    }
+    for(unsigned int i=0; i<nbiases_; i++) {
+      bias_pntrs_[i]->setMultipleWalkersSinglePrecision(mw_single_precision);
+    }
+  }
+  bool mw_async = false;
+  if(keywords.exists("ASYNC_MULTIPLE_WALKERS")) {
+    parseFlag("ASYNC_MULTIPLE_WALKERS",mw_async);
+    if(mw_async && !use_mwalkers_mpi_) {
+      plumed_merror(getName()+": ASYNC_MULTIPLE_WALKERS can only be used together with MULTIPLE_WALKERS");
+    }
+    for(unsigned int i=0; i<nbiases_; i++) {
+      bias_pntrs_[i]->setAsyncMultipleWalkers(mw_async);
+    }
+    if(mw_async && mw_single_precision) {
+      plumed_merror(getName()+": MULTIPLE_WALKERS_SINGLE_PRECISION cannot be used together with ASYNC_MULTIPLE_WALKERS");
+    }
+  }
+  if(keywords.exists("DISTRIBUTED_HESSIAN")) {
+    bool distributed_hessian = false;
+    parseFlag("DISTRIBUTED_HESSIAN",distributed_hessian);
+    if(distributed_hessian) {
+      if(diagonal_hessian_) {
+        plumed_merror(getName()+": DISTRIBUTED_HESSIAN can only be used with FULL_HESSIAN");
+      }
+      for(unsigned int i=0; i<nbiases_; i++) {
+        if(use_mwalkers_mpi_ || bias_pntrs_[i]->walkersDirectoryActive()) {
+          plumed_merror(getName()+": DISTRIBUTED_HESSIAN cannot be used together with multiple walkers");
+        }
+        bias_pntrs_[i]->setDistributedHessian(distributed_hessian);
+      }
+      log.printf("  the accumulated sums of the products needed for the full Hessian are distributed over the MPI ranks, the coefficients, the gradient and the Hessian are replicated\n");
+    }
+  }
 
   int numwalkers=1;
   int walker_rank=0;
@@ -223,6 +298,9 @@ Optimizer::Optimizer(const ActionOptions&ao):
     log.printf("  optimization performed using multiple walkers connected via MPI:\n");
     log.printf("   number of walkers: %d\n",numwalkers);
     log.printf("   walker number: %d\n",walker_rank);
+    if(mw_async) {
+      log.printf("   the averages of the walkers are combined without blocking and used at the following iteration\n");
+    }
     log.printf("   please see and cite ");
     log << plumed.cite("Raiteri, Laio, Gervasio, Micheletti, and Parrinello, J. Phys. Chem. B 110, 3533 (2006)");
     log.printf("\n");
@@ -498,6 +576,7 @@ Optimizer::Optimizer(const ActionOptions&ao):
       coeffs_mask_pntrs_[i]->setLabels("mask");
       coeffs_mask_pntrs_[i]->setValues(1.0);
       coeffs_mask_pntrs_[i]->setOutputFmt("%f");
+      coeffs_pntrs_[i]->getPntrToVesBias()->linkCoeffsMask(coeffs_pntrs_[i],coeffs_mask_pntrs_[i]);
     }
 
     if(mask_fnames_in.size()>0) {
@@ -713,7 +792,7 @@ Optimizer::Optimizer(const ActionOptions&ao):
   
 // Added By Y. Isaac Yang to calculte the reweighting factor
   for(unsigned int i=0; i<nbiases_; i++){
-    bias_pntrs_[i]->updateReweightingFactor();
+    if(bias_pntrs_[i]->isReweightFactorCalculated()) {bias_pntrs_[i]->updateReweightingFactor();}
   }
 //
 
@@ -841,11 +920,17 @@ void Optimizer::registerKeywords( Keywords& keys ) {
   keys.reserve("compulsory","INITIAL_STEPSIZE","the initial step size used for the optimization");
   // Keywords related to the Hessian, actived with the useHessianKeywords function
   keys.reserveFlag("FULL_HESSIAN",false,"if the full Hessian matrix should be used for the optimization, otherwise only the diagonal part of the Hessian is used");
+  keys.reserveFlag("DISTRIBUTED_HESSIAN",false,"if each MPI rank should only store the rows of the accumulated sums of the products of the basis functions that it updates. Only these sums are distributed, the coefficients, the averages, the gradient and the Hessian are replicated on all ranks and the covariance is gathered into a full size array on all ranks at each update. The memory per rank is thus reduced by the size of the sums but still grows with the square of the number of coefficients and does not scale with the inverse of the number of ranks. Can only be used with FULL_HESSIAN and not with multiple walkers.");
+  keys.reserve("optional","HESSIAN_BUFFER_SIZE","the number of samples that are buffered before updating the off-diagonal part of the Hessian in one go, which is faster for large sets of coefficients. Can only be used with FULL_HESSIAN.");
   keys.reserve("hidden","HESSIAN_FILE","the name of output file for the Hessian");
   keys.reserve("hidden","HESSIAN_OUTPUT","how often the Hessian should be written to file. This parameter is given as the number of bias iterations. It is by default 100 if HESSIAN_FILE is specficed");
   keys.reserve("hidden","HESSIAN_FMT","specify format for hessian file(s) (useful for decrease the number of digits in regtests)");
   // Keywords related to the multiple walkers, actived with the useMultipleWalkersKeywords function
   keys.reserveFlag("MULTIPLE_WALKERS",false,"if optimization is to be performed using multiple walkers connected via MPI");
+  keys.reserveFlag("MULTIPLE_WALKERS_SINGLE_PRECISION",false,"if the averages of the multiple walkers should be communicated in single precision, which halves the amount of data communicated at each iteration at the cost of the precision of the averages.");
+  keys.reserve("optional","WALKERS_DIRECTORY","a directory shared by multiple walkers that are run as independent simulations. At each iteration, the averages of each walker are written to a file in this directory and the averages written by the other walkers since the previous iteration are included.");
+  keys.reserve("optional","WALKER_ID","the identifier of this walker when using WALKERS_DIRECTORY, which should be different for each walker.");
+  keys.reserveFlag("ASYNC_MULTIPLE_WALKERS",false,"if the averages of the multiple walkers should be combined with a non-blocking reduction such that the walkers do not wait on each other. The coefficients are then updated using the averages from the previous iteration, and are thus not updated at the first iteration. The averages used are always exactly one iteration old, a larger lag between the walkers is not possible as the reduction of the previous iteration is completed before a new one is started.");
   // Keywords related to the mask file, actived with the useMaskKeywords function
   keys.reserve("optional","MASK_FILE","read in a mask file which allows one to employ different step sizes for different coefficents and/or deactive the optimization of certain coefficients (by putting values of 0.0). One can write out the resulting mask by using the OUTPUT_MASK_FILE keyword.");
   keys.reserve("optional","OUTPUT_MASK_FILE","Name of the file to write out the mask resulting from using the MASK_FILE keyword. Can also be used to generate a template mask file.");
@@ -886,6 +971,8 @@ void Optimizer::registerKeywords( Keywords& keys ) {
 
 void Optimizer::useHessianKeywords(Keywords& keys) {
   // keys.use("FULL_HESSIAN");
+  keys.use("HESSIAN_BUFFER_SIZE");
+  keys.use("DISTRIBUTED_HESSIAN");
   keys.use("HESSIAN_FILE");
   keys.use("HESSIAN_OUTPUT");
   keys.use("HESSIAN_FMT");
@@ -894,6 +981,10 @@ void Optimizer::useHessianKeywords(Keywords& keys) {
 
 void Optimizer::useMultipleWalkersKeywords(Keywords& keys) {
   keys.use("MULTIPLE_WALKERS");
+  keys.use("ASYNC_MULTIPLE_WALKERS");
+  keys.use("MULTIPLE_WALKERS_SINGLE_PRECISION");
+  keys.use("WALKERS_DIRECTORY");
+  keys.use("WALKER_ID");
 }
 
 
@@ -1023,10 +1114,16 @@ void Optimizer::update() {
       bias_pntrs_[i]->updateGradientAndHessian(use_mwalkers_mpi_);
     }
     for(unsigned int i=0; i<ncoeffssets_; i++) {
-      if(gradient_pntrs_[i]->isActive()) {coeffsUpdate(i);}
+      if(gradient_pntrs_[i]->isActive()) {
+        coeffsUpdate(i);
+        coeffs_pntrs_[i]->getPntrToVesBias()->increaseCoeffsVersion();
+      }
+      else if(coeffs_pntrs_[i]->getPntrToVesBias()->asyncWarmUp()) {
+        log.printf("  iteration %s for %s - the coefficients are not updated as the averages of the walkers are only available at the next iteration\n",getIterationCounterStr(+1).c_str(),coeffs_pntrs_[i]->getPntrToVesBias()->getLabel().c_str());
+      }
       else {
         std::string msg = "iteration " + getIterationCounterStr(+1) +
-                          " for " + bias_pntrs_[i]->getLabel() +
+                          " for " + coeffs_pntrs_[i]->getPntrToVesBias()->getLabel() +
                           " - the coefficients are not updated as CV values are outside the bias intervals";
         warning(msg);
       }
@@ -1058,17 +1155,14 @@ void Optimizer::update() {
         }
       }
     }
+    // Added by Y. Isaac Yang to calculate the reweighting factor, only
+    // done when requested with CALC_REWEIGHT_FACTOR at REWEIGHT_FACTOR_STRIDE
     if(ustride_reweightfactor_>0 && getIterationCounter()%ustride_reweightfactor_==0) {
       for(unsigned int i=0; i<nbiases_; i++) {
+        bias_pntrs_[i]->updateReweightingFactor();
         bias_pntrs_[i]->updateReweightFactor();
       }
     }
-
-    // Added by Y. Isaac Yang to calculate the reweighting factor
-    for(unsigned int i=0; i<nbiases_; i++){
-      bias_pntrs_[i]->updateReweightingFactor();
-    }
-    //
     if(isBiasOutputActive() && getIterationCounter()%getBiasOutputStride()==0) {
       writeBiasOutputFiles();
     }
@@ -1217,6 +1311,7 @@ void Optimizer::readCoeffsFromFiles(const std::vector<std::string>& fnames, cons
     else {
       AuxCoeffs(i).setValues( Coeffs(i) );
     }
+    coeffs_pntrs_[i]->getPntrToVesBias()->increaseCoeffsVersion();
   }
 }
 
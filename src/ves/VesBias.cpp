@@ -35,10 +35,29 @@
 #include "core/Atoms.h"
 #include "tools/File.h"
 
+#include <algorithm>
+#include <limits>
+#include <cstdio>
+#include <cstdint>
+#include <dirent.h>
+
 
 namespace PLMD {
 namespace ves {
 
+#if defined(__PLUMED_HAS_MPI) && MPI_VERSION>=3
+#define VES_NONBLOCKING_MULTISIM_REDUCTION
+#endif
+
+namespace {
+// identifies the binary files used to exchange the sums between walkers
+const std::uint64_t walker_file_magic = 0x5645535741564732ULL;
+// number of columns of the Hessian updated at the time when flushing the
+// buffered samples, such that the corresponding part of the buffer stays in cache
+const size_t hessian_buffer_column_block = 256;
+}
+
+
 VesBias::VesBias(const ActionOptions&ao):
   Action(ao),
   Bias(ao),
@@ -47,16 +66,43 @@ VesBias::VesBias(const ActionOptions&ao):
   targetdist_averages_pntrs_(0),
   gradient_pntrs_(0),
   hessian_pntrs_(0),
+  coeffs_mask_pntrs_(0),
   sampled_averages(0),
   sampled_cross_averages(0),
   use_multiple_coeffssets_(false),
+  coeffs_version_(1),
   coeffs_fnames(0),
   ncoeffs_total_(0),
   optimizer_pntr_(NULL),
   optimize_coeffs_(false),
+  static_bias_keyword_(""),
   compute_hessian_(false),
   diagonal_hessian_(true),
   aver_counters(0),
+  owned_coeffs_begin_(0),
+  owned_coeffs_end_(0),
+  distributed_hessian_(false),
+  cross_sums_offset_(0),
+  cross_sums_counts_(0),
+  cross_sums_displs_(0),
+  averaging_stride_(1),
+  hessian_buffer_size_(0),
+  hessian_buffers_(0),
+  hessian_buffer_counters_(0),
+  mwalkers_async_(false),
+  mwalkers_send_buffers_(0),
+  mwalkers_recv_buffers_(0),
+  mwalkers_requests_(0),
+  mwalkers_pending_(0),
+  mwalkers_async_updates_(0),
+  mwalkers_comm_setup_(false),
+  mwalkers_single_precision_(false),
+  walkers_directory_(""),
+  walker_id_(""),
+  walkers_sequence_(0),
+  walkers_own_totals_(0),
+  walkers_last_read_(0),
+  walkers_last_totals_(0),
   kbt_(0.0),
   targetdist_pntrs_(0),
   dynamic_targetdist_(false),
@@ -218,6 +264,24 @@ VesBias::VesBias(const ActionOptions&ao):
   }
 
 
+  if(getStride()>1) {
+    log.printf("  bias evaluated every %d steps, the forces are applied as impulses multiplied by the stride\n",getStride());
+  }
+  if(keywords.exists("AVERAGING_STRIDE")) {
+    // the samples can only be taken on the steps where the bias is evaluated
+    averaging_stride_ = getStride();
+    parse("AVERAGING_STRIDE",averaging_stride_);
+    if(averaging_stride_==0) {
+      plumed_merror("the value given in AVERAGING_STRIDE doesn't make sense, it should be larger than 0");
+    }
+    if(averaging_stride_%getStride()!=0) {
+      plumed_merror("the value given in AVERAGING_STRIDE should be a multiple of the STRIDE of the bias");
+    }
+    if(averaging_stride_>1) {
+      log.printf("  samples for the averages taken every %u steps\n",averaging_stride_);
+    }
+  }
+
   if(keywords.exists("PROJ_ARG")) {
     std::vector<std::string> proj_arg;
     for(int i=1;; i++) {
@@ -246,12 +310,10 @@ VesBias::VesBias(const ActionOptions&ao):
     }
   }
 
+  // the rct component is always added, c(t) is only calculated if requested
+  // and then first obtained at the first update of the coefficients
   if(keywords.exists("CALC_REWEIGHT_FACTOR")) {
     parseFlag("CALC_REWEIGHT_FACTOR",calc_reweightfactor_);
-    if(calc_reweightfactor_) {
-      addComponent("rct"); componentIsNotPeriodic("rct");
-      updateReweightFactor();
-    }
   }
   
   // Added By Y. Isaac Yang to calculte the reweighting factor
@@ -278,6 +340,12 @@ VesBias::VesBias(const ActionOptions&ao):
 
 
 VesBias::~VesBias() {
+#ifdef VES_NONBLOCKING_MULTISIM_REDUCTION
+  // all walkers have posted the same reductions
+  for(unsigned int i=0; i<mwalkers_pending_.size(); i++) {
+    if(mwalkers_pending_[i] && comm.Get_rank()==0) {mwalkers_requests_[i].wait();}
+  }
+#endif
   for(unsigned int i=0; i<coeffs_pntrs_.size(); i++) {
     delete coeffs_pntrs_[i];
   }
@@ -321,12 +389,14 @@ void VesBias::registerKeywords( Keywords& keys ) {
   keys.reserve("optional","BIAS_CUTOFF","cutoff the bias such that it only fills the free energy surface up to certain level F_cutoff, here you should give the value of the F_cutoff.");
   keys.reserve("optional","BIAS_CUTOFF_FERMI_LAMBDA","the lambda value used in the Fermi switching function for the bias cutoff (BIAS_CUTOFF), the default value is 10.0.");
   //
+  keys.reserve("optional","AVERAGING_STRIDE","the frequency, given in the number of MD steps, with which the samples used for the averages in the optimization are taken. The bias and forces are still applied at every step. As consecutive steps are strongly correlated, a stride larger than 1 reduces the cost with little loss of statistical efficiency. The stride of the optimizer should be a multiple of this value. The default value is 1, or the STRIDE of the bias if it is given.");
+  //
   keys.reserve("numbered","PROJ_ARG","arguments for doing projections of the FES or the target distribution.");
   //
   keys.reserveFlag("CALC_REWEIGHT_FACTOR",false,"enable the calculation of the reweight factor c(t). You should also give a stride for updating the reweight factor in the optimizer by using the REWEIGHT_FACTOR_STRIDE keyword if the coefficients are updated.");
   // Added By Y. Isaac Yang to calculte the reweighting factor
-  keys.addOutputComponent("rbias","default","the instantaneous value of the bias normalized using the \\f$c(t)\\f$ reweighting factor [rbias=bias-c(t)]. This component can be used to obtain a reweighted histogram.");
-  keys.addOutputComponent("rct","default","the reweighting factor \\f$c(t)\\f$.");
+  keys.addOutputComponent("rbias","default","the instantaneous value of the bias normalized using the \\f$c(t)\\f$ reweighting factor [rbias=bias-c(t)]. This component can be used to obtain a reweighted histogram. The reweighting factor is only calculated if the CALC_REWEIGHT_FACTOR flag is used, otherwise it is zero.");
+  keys.addOutputComponent("rct","default","the reweighting factor \\f$c(t)\\f$, only calculated if the CALC_REWEIGHT_FACTOR flag is used and zero otherwise.");
   keys.reserve("optional","REWEIGHT_BINS","the number of bins used to calculate the reweight factor. The default value is 100 bins per dimension.");
   keys.reserve("optional","REWEIGHT_MIN","the lower bounds used to calculate the reweight factor.");
   keys.reserve("optional","REWEIGHT_MAX","the upper bounds used to calculate the reweight factor.");
@@ -377,6 +447,18 @@ void VesBias::useBiasCutoffKeywords(Keywords& keys) {
 }
 
 
+void VesBias::useAveragingStrideKeywords(Keywords& keys) {
+  keys.use("AVERAGING_STRIDE");
+}
+
+
+void VesBias::useMultipleTimeStepKeywords(Keywords& keys) {
+  // STRIDE is registered as a hidden keyword in Bias, the forces are
+  // multiplied by the stride when they are applied (impulse)
+  keys.reset_style("STRIDE","compulsory");
+}
+
+
 void VesBias::useProjectionArgKeywords(Keywords& keys) {
   keys.use("PROJ_ARG");
 }
@@ -384,7 +466,6 @@ void VesBias::useProjectionArgKeywords(Keywords& keys) {
 
 void VesBias::useReweightFactorKeywords(Keywords& keys) {
   keys.use("CALC_REWEIGHT_FACTOR");
-  keys.addOutputComponent("rct","CALC_REWEIGHT_FACTOR","the reweight factor c(t).");
 }
 
 
@@ -433,6 +514,8 @@ void VesBias::initializeCoeffs(CoeffsVector* coeffs_pntr_in) {
   CoeffsMatrix* hessian_tmp = new CoeffsMatrix(label,coeffs_pntr_in,comm,diagonal_hessian_);
   hessian_pntrs_.push_back(hessian_tmp);
   //
+  coeffs_mask_pntrs_.push_back(NULL);
+  //
   std::vector<double> aver_sampled_tmp;
   aver_sampled_tmp.assign(coeffs_pntr_in->numberOfCoeffs(),0.0);
   sampled_averages.push_back(aver_sampled_tmp);
@@ -444,6 +527,7 @@ void VesBias::initializeCoeffs(CoeffsVector* coeffs_pntr_in) {
   aver_counters.push_back(0);
   //
   ncoeffssets_++;
+  setupCoeffsOwnership();
 }
 
 
@@ -478,24 +562,62 @@ bool VesBias::readCoeffsFromFiles() {
       ifile.close();
     }
     read_coeffs = true;
+    increaseCoeffsVersion();
   }
   return read_coeffs;
 }
 
 
 void VesBias::updateGradientAndHessian(const bool use_mwalkers_mpi) {
+  std::vector<unsigned int> total_samples(aver_counters);
+  for(unsigned int k=0; k<ncoeffssets_; k++) {flushHessianBuffer(k);}
+  // the rank-local sums are only reduced here, once per update of the coefficients,
+  // with the sums of all coefficient sets packed in a single buffer
+  bool single_stage = use_mwalkers_mpi && !mwalkers_async_;
+  if(single_stage) {
+    // the averages, the weights and the number of samples of all walkers are
+    // reduced at once over all the ranks of all the walkers
+    if(!mwalkers_comm_setup_) {setupWalkersCommunicator();}
+    if(mwalkers_single_precision_) {
+      std::vector<float> buffer;
+      reducePackedSums(mwalkers_comm_,buffer,true,total_samples);
+    }
+    else {
+      std::vector<double> buffer;
+      reducePackedSums(mwalkers_comm_,buffer,true,total_samples);
+    }
+  }
+  else if(comm.Get_size()>1) {
+    std::vector<double> buffer;
+    reducePackedSums(comm,buffer,false,total_samples);
+  }
+  if(use_mwalkers_mpi && mwalkers_async_) {mwalkers_async_updates_++;}
+  //
   for(unsigned int k=0; k<ncoeffssets_; k++) {
-    //
-    comm.Sum(sampled_averages[k]);
-    comm.Sum(sampled_cross_averages[k]);
-    if(use_mwalkers_mpi) {
-      double walker_weight=1.0;
-      if(aver_counters[k]==0) {walker_weight=0.0;}
-      multiSimSumAverages(k,walker_weight);
+    if(!single_stage) {
+      if(walkers_directory_.size()>0) {exchangeSumsWithWalkers(k);}
+      // the sums are turned into averages, for multiple walkers this is done
+      // together with the weighting of the walkers
+      double sums_norm = 1.0;
+      if(aver_counters[k]>0) {sums_norm = 1.0/static_cast<double>(aver_counters[k]);}
+      total_samples[k] = aver_counters[k];
+      if(use_mwalkers_mpi) {
+        double walker_weight=1.0;
+        if(aver_counters[k]==0) {walker_weight=0.0;}
+        multiSimSumAveragesAsync(k,walker_weight,sums_norm,total_samples[k]);
+      }
+      else if(sums_norm!=1.0) {
+        std::vector<std::vector<double>*> sums;
+        getSumsPntrs(k,sums);
+        for(size_t j=0; j<sums.size(); j++) {
+          for(size_t i=0; i<sums[j]->size(); i++) {(*sums[j])[i] *= sums_norm;}
+        }
+      }
     }
     // NOTE: this assumes that all walkers have the same TargetDist, might change later on!!
     Gradient(k).setValues( TargetDistAverages(k) - sampled_averages[k] );
-    Hessian(k) = computeCovarianceFromAverages(k);
+    std::vector<double> covariance = computeCovarianceFromAverages(k);
+    Hessian(k) = covariance;
     Hessian(k) *= getBeta();
     //
     Gradient(k).activate();
@@ -503,12 +625,7 @@ void VesBias::updateGradientAndHessian(const bool use_mwalkers_mpi) {
     //
     // Check the total number of samples (from all walkers) and deactivate the Gradient and Hessian if it
     // is zero
-    unsigned int total_samples = aver_counters[k];
-    if(use_mwalkers_mpi) {
-      if(comm.Get_rank()==0) {multi_sim_comm.Sum(total_samples);}
-      comm.Bcast(total_samples,0);
-    }
-    if(total_samples==0) {
+    if(total_samples[k]==0) {
       Gradient(k).deactivate();
       Gradient(k).clear();
       Hessian(k).deactivate();
@@ -522,60 +639,341 @@ void VesBias::updateGradientAndHessian(const bool use_mwalkers_mpi) {
 }
 
 
-void VesBias::multiSimSumAverages(const unsigned int c_id, const double walker_weight) {
-  plumed_massert(walker_weight>=0.0,"the weight of the walker cannot be negative!");
-  if(walker_weight!=1.0) {
-    for(size_t i=0; i<sampled_averages[c_id].size(); i++) {
-      sampled_averages[c_id][i] *= walker_weight;
+void VesBias::getSumsPntrs(const unsigned int c_id, std::vector<std::vector<double>*>& sums, const bool replicated_only) {
+  // the distributed sums of the products are not replicated over the ranks
+  sums.clear();
+  sums.push_back(&sampled_averages[c_id]);
+  if(!(replicated_only && distributedCrossSums())) {sums.push_back(&sampled_cross_averages[c_id]);}
+}
+
+
+template<class T>
+void VesBias::reducePackedSums(Communicator& reduce_comm, std::vector<T>& buffer, const bool walker_totals, std::vector<unsigned int>& total_samples) {
+  /*
+  The sums of all coefficient sets are packed in a single buffer that is
+  reduced in one collective. With walker_totals the sums of each walker are
+  turned into averages and weighted before the reduction, and the weight
+  and the number of samples of each walker are appended to the buffer (only
+  by rank 0 of each walker, the sums are distributed over the ranks). The
+  averages are then normalized by the total weight of the walkers.
+  */
+  plumed_massert(!(walker_totals && distributedCrossSums()),"the distributed Hessian cannot be used with multiple walkers");
+  std::vector<std::vector<double>*> sums;
+  size_t nsums = 0;
+  for(unsigned int k=0; k<ncoeffssets_; k++) {
+    getSumsPntrs(k,sums,true);
+    for(size_t j=0; j<sums.size(); j++) {nsums += sums[j]->size();}
+  }
+  size_t ntotals = walker_totals ? 2*ncoeffssets_ : 0;
+  buffer.resize(nsums+ntotals);
+  //
+  size_t pos = 0;
+  for(unsigned int k=0; k<ncoeffssets_; k++) {
+    double scale = 1.0;
+    if(walker_totals) {
+      // walkers without samples get zero weight
+      scale = aver_counters[k]>0 ? 1.0/static_cast<double>(aver_counters[k]) : 0.0;
+    }
+    getSumsPntrs(k,sums,true);
+    for(size_t j=0; j<sums.size(); j++) {
+      for(size_t i=0; i<sums[j]->size(); i++) {buffer[pos++] = static_cast<T>(scale*(*sums[j])[i]);}
     }
-    for(size_t i=0; i<sampled_cross_averages[c_id].size(); i++) {
-      sampled_cross_averages[c_id][i] *= walker_weight;
+  }
+  if(walker_totals) {
+    bool leader = comm.Get_rank()==0;
+    for(unsigned int k=0; k<ncoeffssets_; k++) {
+      buffer[nsums+2*k] = (leader && aver_counters[k]>0) ? 1.0 : 0.0;
+      buffer[nsums+2*k+1] = leader ? static_cast<T>(aver_counters[k]) : 0.0;
+    }
+  }
+  //
+  reduce_comm.Sum(buffer);
+  //
+  pos = 0;
+  for(unsigned int k=0; k<ncoeffssets_; k++) {
+    double norm_weights = 1.0;
+    if(walker_totals) {
+      norm_weights = static_cast<double>(buffer[nsums+2*k]);
+      if(norm_weights>0.0) {norm_weights=1.0/norm_weights;}
+      total_samples[k] = static_cast<unsigned int>(buffer[nsums+2*k+1]+0.5);
     }
+    getSumsPntrs(k,sums,true);
+    for(size_t j=0; j<sums.size(); j++) {
+      for(size_t i=0; i<sums[j]->size(); i++) {(*sums[j])[i] = norm_weights*static_cast<double>(buffer[pos++]);}
+    }
+  }
+}
+
+
+void VesBias::setupWalkersCommunicator() {
+  /*
+  The communicator spanning all ranks of all walkers is obtained by merging
+  the communicators of the walkers pairwise in log2(nwalkers) steps, where
+  the leaders of the merged groups are connected through multi_sim_comm.
+  The lower group comes first in each merge, such that rank 0 of the merged
+  communicator is always the leader of the first walker of the group.
+  */
+#ifdef __PLUMED_HAS_MPI
+  int nwalkers = 0;
+  int walker = 0;
+  if(comm.Get_rank()==0) {
+    nwalkers = multi_sim_comm.Get_size();
+    walker = multi_sim_comm.Get_rank();
   }
+  comm.Bcast(nwalkers,0);
+  comm.Bcast(walker,0);
+  // the peer communicator is only significant for the leaders
+  MPI_Comm peer = comm.Get_rank()==0 ? multi_sim_comm.Get_comm() : MPI_COMM_NULL;
+  MPI_Comm current;
+  MPI_Comm_dup(comm.Get_comm(),&current);
+  for(int step=1; step<nwalkers; step*=2) {
+    int group = walker/step;
+    int partner_leader = (group^1)*step;
+    if(partner_leader>=nwalkers) {continue;}
+    MPI_Comm intercomm;
+    MPI_Comm merged;
+    MPI_Intercomm_create(current,0,peer,partner_leader,step,&intercomm);
+    MPI_Intercomm_merge(intercomm,group%2,&merged);
+    MPI_Comm_free(&intercomm);
+    MPI_Comm_free(&current);
+    current = merged;
+  }
+  mwalkers_comm_.Set_comm(current);
+  MPI_Comm_free(&current);
+#endif
+  mwalkers_comm_setup_ = true;
+}
+
+
+void VesBias::multiSimSumAveragesAsync(const unsigned int c_id, const double walker_weight, const double sums_norm, unsigned int& total_samples) {
+  /*
+  The averages of this walker are reduced over the walkers with a non-blocking
+  reduction that is only completed at the next update, such that the walkers
+  do not wait on each other. The averages returned are thus the ones of the
+  previous update, i.e. they are at most one stride old. At the first update
+  there are none and total_samples is set to zero.
+  */
+  plumed_massert(walker_weight>=0.0,"the weight of the walker cannot be negative!");
+  std::vector<double>& averages = sampled_averages[c_id];
+  std::vector<double>& cross_averages = sampled_cross_averages[c_id];
+  size_t naver = averages.size();
+  size_t ncross = cross_averages.size();
+  size_t nbuffer = naver+ncross+2;
+  std::vector<double>& send_buffer = mwalkers_send_buffers_[c_id];
+  std::vector<double>& recv_buffer = mwalkers_recv_buffers_[c_id];
   //
+  double samples = 0.0;
   if(comm.Get_rank()==0) {
-    multi_sim_comm.Sum(sampled_averages[c_id]);
-    multi_sim_comm.Sum(sampled_cross_averages[c_id]);
-    double norm_weights = walker_weight;
-    multi_sim_comm.Sum(norm_weights);
-    if(norm_weights>0.0) {norm_weights=1.0/norm_weights;}
-    for(size_t i=0; i<sampled_averages[c_id].size(); i++) {
-      sampled_averages[c_id][i] *= norm_weights;
+    bool have_previous = mwalkers_pending_[c_id];
+#ifdef VES_NONBLOCKING_MULTISIM_REDUCTION
+    if(have_previous) {mwalkers_requests_[c_id].wait();}
+#endif
+    mwalkers_pending_[c_id] = false;
+    // the send buffer is free once the previous reduction is completed
+    send_buffer.resize(nbuffer);
+    double scale = walker_weight*sums_norm;
+    for(size_t i=0; i<naver; i++) {send_buffer[i] = scale*averages[i];}
+    for(size_t i=0; i<ncross; i++) {send_buffer[naver+i] = scale*cross_averages[i];}
+    send_buffer[nbuffer-2] = walker_weight;
+    send_buffer[nbuffer-1] = static_cast<double>(aver_counters[c_id]);
+    //
+    if(have_previous) {
+      double norm_weights = recv_buffer[nbuffer-2];
+      if(norm_weights>0.0) {norm_weights=1.0/norm_weights;}
+      for(size_t i=0; i<naver; i++) {averages[i] = norm_weights*recv_buffer[i];}
+      for(size_t i=0; i<ncross; i++) {cross_averages[i] = norm_weights*recv_buffer[naver+i];}
+      samples = recv_buffer[nbuffer-1];
     }
-    for(size_t i=0; i<sampled_cross_averages[c_id].size(); i++) {
-      sampled_cross_averages[c_id][i] *= norm_weights;
+    else {
+      std::fill(averages.begin(),averages.end(),0.0);
+      std::fill(cross_averages.begin(),cross_averages.end(),0.0);
     }
+    //
+    recv_buffer.assign(nbuffer,0.0);
+#ifdef VES_NONBLOCKING_MULTISIM_REDUCTION
+    MPI_Iallreduce(&send_buffer[0],&recv_buffer[0],static_cast<int>(nbuffer),MPI_DOUBLE,MPI_SUM,multi_sim_comm.Get_comm(),&mwalkers_requests_[c_id].r);
+#else
+    // without non-blocking collectives the reduction is done right away,
+    // the result is still only used at the next update
+    recv_buffer = send_buffer;
+    multi_sim_comm.Sum(recv_buffer);
+#endif
+    mwalkers_pending_[c_id] = true;
   }
-  comm.Bcast(sampled_averages[c_id],0);
-  comm.Bcast(sampled_cross_averages[c_id],0);
+  comm.Bcast(averages,0);
+  comm.Bcast(cross_averages,0);
+  comm.Bcast(samples,0);
+  total_samples = static_cast<unsigned int>(samples+0.5);
 }
 
 
 void VesBias::addToSampledAverages(const std::vector<double>& values, const unsigned int c_id) {
   /*
-  use the following online equation to calculate the average and covariance
-  (see https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance#Covariance)
-      xm[n+1] = xm[n] + (x[n+1]-xm[n])/(n+1)
+  the sums of the values and of their products are accumulated and only
+  divided by the number of samples in updateGradientAndHessian(), in this
+  way samples where most of the values are zero only need to update the
+  non-zero entries (see the overload below)
   */
-  double counter_dbl = static_cast<double>(aver_counters[c_id]);
   size_t ncoeffs = numberOfCoeffs(c_id);
-  std::vector<double> deltas(ncoeffs,0.0);
-  size_t stride = comm.Get_size();
-  size_t rank = comm.Get_rank();
-  // update average and diagonal part of Hessian
-  for(size_t i=rank; i<ncoeffs; i+=stride) {
-    size_t midx = getHessianIndex(i,i,c_id);
-    deltas[i] = (values[i]-sampled_averages[c_id][i])/(counter_dbl+1); // (x[n+1]-xm[n])/(n+1)
-    sampled_averages[c_id][i] += deltas[i];
-    sampled_cross_averages[c_id][midx] += (values[i]*values[i]-sampled_cross_averages[c_id][midx])/(counter_dbl+1);
-  }
-  comm.Sum(deltas);
+  size_t begin = owned_coeffs_begin_[c_id];
+  size_t end = owned_coeffs_end_[c_id];
+  size_t offset = cross_sums_offset_[c_id];
+  // update sums and diagonal part of Hessian for the owned coefficients
+  for(size_t i=begin; i<end; i++) {
+    size_t midx = getHessianIndex(i,i,c_id)-offset;
+    sampled_averages[c_id][i] += values[i];
+    sampled_cross_averages[c_id][midx] += values[i]*values[i];
+  }
   // update off-diagonal part of the Hessian
-  if(!diagonal_hessian_) {
-    for(size_t i=rank; i<ncoeffs; i+=stride) {
+  if(!diagonal_hessian_ && hessian_buffer_size_>0) {
+    std::copy(values.begin(),values.end(),hessian_buffers_[c_id].begin()+hessian_buffer_counters_[c_id]*ncoeffs);
+    if(++hessian_buffer_counters_[c_id]==hessian_buffer_size_) {
+      flushHessianBuffer(c_id);
+    }
+  }
+  else if(!diagonal_hessian_) {
+    for(size_t i=begin; i<end; i++) {
       for(size_t j=(i+1); j<ncoeffs; j++) {
-        size_t midx = getHessianIndex(i,j,c_id);
-        sampled_cross_averages[c_id][midx] += (values[i]*values[j]-sampled_cross_averages[c_id][midx])/(counter_dbl+1);
+        size_t midx = getHessianIndex(i,j,c_id)-offset;
+        sampled_cross_averages[c_id][midx] += values[i]*values[j];
+      }
+    }
+  }
+  // NOTE: the MPI sum for sampled_averages and sampled_cross_averages is done later
+  aver_counters[c_id] += 1;
+}
+
+
+void VesBias::addToSampledAverages(const std::vector< std::vector<double> >& tensor_values, const double scale, const unsigned int c_id) {
+  /*
+  fused version for a diagonal Hessian where the values are the tensor
+  product of the values in each dimension (the first one fastest varying)
+  multiplied by scale, except the first one, i.e. the constant term, which is
+  not scaled. The products are accumulated directly into the sums without
+  storing them, skipping the zero values in each dimension. Only the owned
+  coefficients are updated.
+  */
+  plumed_massert(tensorProductAveragesPossible(),"the tensor product of the values can only be accumulated directly for a diagonal Hessian");
+  unsigned int ndim = tensor_values.size();
+  size_t begin = owned_coeffs_begin_[c_id];
+  size_t end = owned_coeffs_end_[c_id];
+  std::vector<double>& sums = sampled_averages[c_id];
+  std::vector<double>& cross_sums = sampled_cross_averages[c_id];
+  //
+  tensor_nonzero_.resize(ndim);
+  tensor_pos_.assign(ndim,0);
+  size_t nrows = 1;
+  for(unsigned int k=0; k<ndim; k++) {
+    tensor_nonzero_[k].clear();
+    for(unsigned int i=0; i<tensor_values[k].size(); i++) {
+      if(tensor_values[k][i]!=0.0) {tensor_nonzero_[k].push_back(i);}
+    }
+    if(k>0) {nrows *= tensor_nonzero_[k].size();}
+  }
+  const std::vector<double>& values0 = tensor_values[0];
+  const std::vector<unsigned int>& nonzero0 = tensor_nonzero_[0];
+  for(size_t r=0; r<nrows; r++) {
+    size_t offset = 0;
+    size_t dim_stride = values0.size();
+    double prod = 1.0;
+    for(unsigned int k=1; k<ndim; k++) {
+      unsigned int idx = tensor_nonzero_[k][tensor_pos_[k]];
+      offset += idx*dim_stride;
+      prod *= tensor_values[k][idx];
+      dim_stride *= tensor_values[k].size();
+    }
+    // the rows are visited in increasing order
+    if(offset>=end) {break;}
+    if(offset+values0.size()>begin) {
+      // owned part of the row
+      size_t i0_begin = offset<begin ? begin-offset : 0;
+      size_t i0_end = std::min<size_t>(values0.size(),end-offset);
+      size_t a = std::lower_bound(nonzero0.begin(),nonzero0.end(),i0_begin)-nonzero0.begin();
+      // the diagonal of the Hessian is stored contiguously
+      size_t midx = getHessianIndex(offset,offset,c_id);
+      if(offset==0 && a<nonzero0.size() && nonzero0[a]==0) {
+        double value = prod*values0[0];
+        sums[0] += value;
+        cross_sums[midx] += value*value;
+        a++;
+      }
+      double prod_scaled = scale*prod;
+      for(; a<nonzero0.size() && nonzero0[a]<i0_end; a++) {
+        unsigned int i0 = nonzero0[a];
+        double value = prod_scaled*values0[i0];
+        sums[offset+i0] += value;
+        cross_sums[midx+i0] += value*value;
+      }
+    }
+    for(unsigned int k=1; k<ndim; k++) {
+      if(++tensor_pos_[k]<tensor_nonzero_[k].size()) {break;}
+      tensor_pos_[k]=0;
+    }
+  }
+  // NOTE: the MPI sum for sampled_averages and sampled_cross_averages is done later
+  aver_counters[c_id] += 1;
+}
+
+
+void VesBias::flushHessianBuffer(const unsigned int c_id) {
+  /*
+  adds the products of the buffered samples to the off-diagonal part of the
+  Hessian in one symmetric rank-k update. The rows of the packed upper
+  triangle are contiguous, the columns are updated in blocks such that the
+  part of the buffer needed is reused for all the rows.
+  */
+  if(hessian_buffer_counters_.size()==0 || hessian_buffer_counters_[c_id]==0) {return;}
+  size_t nsamples = hessian_buffer_counters_[c_id];
+  size_t ncoeffs = numberOfCoeffs(c_id);
+  size_t begin = owned_coeffs_begin_[c_id];
+  size_t end = owned_coeffs_end_[c_id];
+  const std::vector<double>& buffer = hessian_buffers_[c_id];
+  std::vector<double>& cross_sums = sampled_cross_averages[c_id];
+  for(size_t jb=0; jb<ncoeffs; jb+=hessian_buffer_column_block) {
+    size_t je = std::min(jb+hessian_buffer_column_block,ncoeffs);
+    for(size_t i=begin; i<end && i+1<je; i++) {
+      size_t j0 = std::max(jb,i+1);
+      // element (i,j) is at offset+j
+      size_t offset = getHessianIndex(i,i,c_id)-cross_sums_offset_[c_id]-i;
+      for(size_t b=0; b<nsamples; b++) {
+        const double* sample = &buffer[b*ncoeffs];
+        double value_i = sample[i];
+        if(value_i==0.0) {continue;}
+        for(size_t j=j0; j<je; j++) {
+          cross_sums[offset+j] += value_i*sample[j];
+        }
+      }
+    }
+  }
+  hessian_buffer_counters_[c_id] = 0;
+}
+
+
+void VesBias::addToSampledAverages(const std::vector<double>& values, const std::vector<size_t>& nonzero_coeffs, const unsigned int c_id) {
+  /*
+  same as above but only for the coefficients given in nonzero_coeffs, which
+  needs to be sorted, the values of the other coefficients are taken as zero
+  */
+  size_t nnonzero = nonzero_coeffs.size();
+  size_t offset = cross_sums_offset_[c_id];
+  // the owned coefficients are a contiguous part of the list
+  size_t a_begin = std::lower_bound(nonzero_coeffs.begin(),nonzero_coeffs.end(),owned_coeffs_begin_[c_id])-nonzero_coeffs.begin();
+  size_t a_end = std::lower_bound(nonzero_coeffs.begin()+a_begin,nonzero_coeffs.end(),owned_coeffs_end_[c_id])-nonzero_coeffs.begin();
+  // update sums and diagonal part of Hessian
+  for(size_t a=a_begin; a<a_end; a++) {
+    size_t i = nonzero_coeffs[a];
+    size_t midx = getHessianIndex(i,i,c_id)-offset;
+    sampled_averages[c_id][i] += values[i];
+    sampled_cross_averages[c_id][midx] += values[i]*values[i];
+  }
+  // update off-diagonal part of the Hessian
+  if(!diagonal_hessian_) {
+    for(size_t a=a_begin; a<a_end; a++) {
+      size_t i = nonzero_coeffs[a];
+      for(size_t b=(a+1); b<nnonzero; b++) {
+        size_t j = nonzero_coeffs[b];
+        size_t midx = getHessianIndex(i,j,c_id)-offset;
+        sampled_cross_averages[c_id][midx] += values[i]*values[j];
       }
     }
   }
@@ -631,12 +1029,26 @@ void VesBias::linkOptimizer(Optimizer* optimizer_pntr_in) {
     std::string err_msg = "VES bias " + getLabel() + " of type " + getName() + " has already been linked with optimizer " + optimizer_pntr_->getLabel() + " of type " + optimizer_pntr_->getName() + ". You cannot link two optimizer to the same VES bias.";
     plumed_merror(err_msg);
   }
+  if(static_bias_keyword_.size()>0) {
+    plumed_merror("Error in keyword "+static_bias_keyword_+" of "+getName()+" with label "+getLabel()+": cannot be used if the coefficients are optimized by optimizer "+optimizer_pntr_in->getLabel());
+  }
   checkThatTemperatureIsGiven();
   optimize_coeffs_ = true;
   filenames_have_iteration_number_ = true;
 }
 
 
+void VesBias::linkCoeffsMask(const CoeffsVector* coeffs_pntr_in, const CoeffsVector* mask_pntr_in) {
+  for(unsigned int i=0; i<ncoeffssets_; i++) {
+    if(coeffs_pntrs_[i]==coeffs_pntr_in) {
+      coeffs_mask_pntrs_[i] = mask_pntr_in;
+      return;
+    }
+  }
+  plumed_merror("VES bias " + getLabel() + ": the coefficients of the mask do not belong to this bias");
+}
+
+
 void VesBias::enableHessian(const bool diagonal_hessian) {
   compute_hessian_=true;
   diagonal_hessian_=diagonal_hessian;
@@ -650,12 +1062,227 @@ void VesBias::enableHessian(const bool diagonal_hessian) {
     cross_aver_sampled_tmp.assign(hessian_pntrs_[i]->getSize(),0.0);
     sampled_cross_averages.push_back(cross_aver_sampled_tmp);
   }
+  setupCoeffsOwnership();
+  //
+  hessian_buffers_.clear();
+  hessian_buffer_counters_.clear();
+  if(!diagonal_hessian_ && hessian_buffer_size_>0) {
+    for(unsigned int i=0; i<ncoeffssets_; i++) {
+      // the flush assumes that the rows of the packed Hessian are contiguous
+      size_t ncoeffs = numberOfCoeffs(i);
+      if(ncoeffs>1) {
+        plumed_massert(getHessianIndex(ncoeffs-2,ncoeffs-1,i)==getHessianIndex(ncoeffs-2,ncoeffs-2,i)+1,"unexpected layout of the Hessian");
+      }
+      hessian_buffers_.push_back(std::vector<double>(hessian_buffer_size_*ncoeffs,0.0));
+      hessian_buffer_counters_.push_back(0);
+    }
+  }
+}
+
+
+void VesBias::setAsyncMultipleWalkers(const bool async) {
+  mwalkers_async_ = async;
+  mwalkers_send_buffers_.assign(ncoeffssets_,std::vector<double>(0));
+  mwalkers_recv_buffers_.assign(ncoeffssets_,std::vector<double>(0));
+  mwalkers_requests_.assign(ncoeffssets_,Communicator::Request());
+  mwalkers_pending_.assign(ncoeffssets_,false);
+  mwalkers_async_updates_ = 0;
+}
+
+
+void VesBias::setWalkersDirectory(const std::string& directory, const std::string& walker_id) {
+  plumed_massert(walker_id.size()>0,"the walker needs an identifier");
+  walkers_directory_ = directory;
+  walker_id_ = walker_id;
+  walkers_sequence_.assign(ncoeffssets_,0);
+  walkers_own_totals_.assign(ncoeffssets_,std::vector<double>(0));
+  walkers_last_read_.assign(ncoeffssets_,std::map<std::string,unsigned long>());
+  walkers_last_totals_.assign(ncoeffssets_,std::map<std::string,std::vector<double> >());
+}
+
+
+void VesBias::exchangeSumsWithWalkers(const unsigned int c_id) {
+  /*
+  Walkers that are run as independent jobs exchange their sums through files
+  in a shared directory. Each walker writes the running totals of its sums
+  and of its number of samples to its own binary file, first to a temporary
+  file that is then renamed such that the other walkers never see a partially
+  written file. For the other walkers the difference between the totals in
+  their files and the totals last read from them is added, such that no
+  stride is lost if a walker wrote several times since it was last read and
+  none is counted twice. Walkers that have stopped or not yet started are
+  simply not included.
+  */
+  std::vector<double>& averages = sampled_averages[c_id];
+  std::vector<double>& cross_averages = sampled_cross_averages[c_id];
+  size_t naver = averages.size();
+  size_t ncross = cross_averages.size();
+  size_t ntotals = naver+ncross+1;
+  double samples = static_cast<double>(aver_counters[c_id]);
+  if(comm.Get_rank()==0) {
+    std::string prefix = getCoeffsSetLabelString("averages",c_id)+".walker-";
+    std::string own_name = prefix+walker_id_+".dat";
+    std::string filename = walkers_directory_+"/"+own_name;
+    std::string tmp_filename = filename+".tmp";
+    //
+    std::vector<double>& own_totals = walkers_own_totals_[c_id];
+    if(own_totals.size()!=ntotals) {own_totals.assign(ntotals,0.0);}
+    for(size_t i=0; i<naver; i++) {own_totals[i] += averages[i];}
+    for(size_t i=0; i<ncross; i++) {own_totals[naver+i] += cross_averages[i];}
+    own_totals[ntotals-1] += samples;
+    walkers_sequence_[c_id]++;
+    std::uint64_t header[4] = {walker_file_magic, naver, ncross, walkers_sequence_[c_id]};
+    std::FILE* fp = std::fopen(tmp_filename.c_str(),"wb");
+    if(fp==NULL) {plumed_merror("VES bias "+getLabel()+": cannot open the walker file "+tmp_filename);}
+    bool written = std::fwrite(header,sizeof(std::uint64_t),4,fp)==4;
+    written = written && std::fwrite(own_totals.data(),sizeof(double),ntotals,fp)==ntotals;
+    written = (std::fclose(fp)==0) && written;
+    if(!written || std::rename(tmp_filename.c_str(),filename.c_str())!=0) {
+      plumed_merror("VES bias "+getLabel()+": cannot write the walker file "+filename);
+    }
+    //
+    std::vector<double> totals(ntotals);
+    DIR* dir = opendir(walkers_directory_.c_str());
+    if(dir!=NULL) {
+      struct dirent* entry;
+      while((entry=readdir(dir))!=NULL) {
+        std::string name(entry->d_name);
+        if(name==own_name || name.size()<=prefix.size()+4) {continue;}
+        if(name.compare(0,prefix.size(),prefix)!=0 || name.compare(name.size()-4,4,".dat")!=0) {continue;}
+        if(!readWalkerFile(walkers_directory_+"/"+name,name,c_id,totals)) {continue;}
+        std::vector<double>& last_totals = walkers_last_totals_[c_id][name];
+        if(last_totals.size()!=ntotals) {last_totals.assign(ntotals,0.0);}
+        for(size_t i=0; i<naver; i++) {averages[i] += totals[i]-last_totals[i];}
+        for(size_t i=0; i<ncross; i++) {cross_averages[i] += totals[naver+i]-last_totals[naver+i];}
+        samples += totals[ntotals-1]-last_totals[ntotals-1];
+        last_totals.swap(totals);
+        totals.resize(ntotals);
+      }
+      closedir(dir);
+    }
+  }
+  comm.Bcast(averages,0);
+  comm.Bcast(cross_averages,0);
+  comm.Bcast(samples,0);
+  aver_counters[c_id] = static_cast<unsigned int>(samples+0.5);
+}
+
+
+bool VesBias::readWalkerFile(const std::string& filename, const std::string& name, const unsigned int c_id, std::vector<double>& totals) {
+  // returns false if the file is not valid or has not changed since it was last read
+  std::FILE* fp = std::fopen(filename.c_str(),"rb");
+  if(fp==NULL) {return false;}
+  std::uint64_t header[4];
+  bool valid = std::fread(header,sizeof(std::uint64_t),4,fp)==4;
+  valid = valid && header[0]==walker_file_magic;
+  valid = valid && header[1]==sampled_averages[c_id].size() && header[2]==sampled_cross_averages[c_id].size();
+  valid = valid && header[1]+header[2]+1==totals.size();
+  std::map<std::string,unsigned long>::const_iterator last_read = walkers_last_read_[c_id].find(name);
+  valid = valid && (last_read==walkers_last_read_[c_id].end() || header[3]>last_read->second);
+  valid = valid && std::fread(totals.data(),sizeof(double),totals.size(),fp)==totals.size();
+  std::fclose(fp);
+  if(valid) {walkers_last_read_[c_id][name] = header[3];}
+  return valid;
+}
+
+
+void VesBias::setHessianBufferSize(const unsigned int buffer_size) {
+  plumed_massert(!compute_hessian_,"the size of the Hessian buffer should be set before enabling the Hessian");
+  hessian_buffer_size_ = buffer_size;
+}
+
+
+void VesBias::setDistributedHessian(const bool distributed_hessian) {
+  plumed_massert(!compute_hessian_,"the distribution of the Hessian should be set before enabling the Hessian");
+  distributed_hessian_ = distributed_hessian;
+}
+
+
+void VesBias::setupCoeffsOwnership() {
+  /*
+  Each rank owns a contiguous block of coefficients, i.e. of rows of the
+  Hessian, for which it accumulates the sums. For the full Hessian row i of
+  the packed upper triangle has ncoeffs-i elements and the blocks are chosen
+  such that each rank gets about the same number of elements. With
+  distributed_hessian_ only the owned rows of the sums of the products are
+  stored. Everything else is replicated: the covariance is gathered into a
+  full size array on all ranks when updating the Hessian, as the CoeffsMatrix
+  of the Hessian and the update of the coefficients by the optimizer work on
+  all the coefficients.
+  */
+  size_t nranks = comm.Get_size();
+  size_t rank = comm.Get_rank();
+  owned_coeffs_begin_.assign(ncoeffssets_,0);
+  owned_coeffs_end_.assign(ncoeffssets_,0);
+  cross_sums_offset_.assign(ncoeffssets_,0);
+  cross_sums_counts_.assign(ncoeffssets_,std::vector<int>(0));
+  cross_sums_displs_.assign(ncoeffssets_,std::vector<int>(0));
+  for(unsigned int k=0; k<ncoeffssets_; k++) {
+    size_t ncoeffs = numberOfCoeffs(k);
+    std::vector<size_t> bounds(nranks+1,ncoeffs);
+    bounds[0] = 0;
+    if(diagonal_hessian_) {
+      for(size_t r=1; r<nranks; r++) {bounds[r] = (r*ncoeffs)/nranks;}
+    }
+    else {
+      size_t nelements = (ncoeffs*(ncoeffs+1))/2;
+      size_t nelements_rows = 0;
+      size_t r = 1;
+      for(size_t i=0; i<ncoeffs && r<nranks; i++) {
+        nelements_rows += ncoeffs-i;
+        while(r<nranks && nelements_rows*nranks>=r*nelements) {bounds[r++] = i+1;}
+      }
+    }
+    owned_coeffs_begin_[k] = bounds[rank];
+    owned_coeffs_end_[k] = bounds[rank+1];
+    //
+    if(distributedCrossSums()) {
+      // the rows of the packed Hessian are assumed to be contiguous
+      if(ncoeffs>1) {
+        plumed_massert(getHessianIndex(ncoeffs-2,ncoeffs-1,k)==getHessianIndex(ncoeffs-2,ncoeffs-2,k)+1,"unexpected layout of the Hessian");
+      }
+      cross_sums_counts_[k].assign(nranks,0);
+      cross_sums_displs_[k].assign(nranks,0);
+      size_t hessian_size = hessian_pntrs_[k]->getSize();
+      for(size_t r=0; r<nranks; r++) {
+        size_t first = bounds[r]<ncoeffs ? getHessianIndex(bounds[r],bounds[r],k) : hessian_size;
+        size_t last = bounds[r+1]<ncoeffs ? getHessianIndex(bounds[r+1],bounds[r+1],k) : hessian_size;
+        plumed_massert(last-first<=static_cast<size_t>(std::numeric_limits<int>::max()),"too many elements of the Hessian on one rank");
+        cross_sums_counts_[k][r] = static_cast<int>(last-first);
+        cross_sums_displs_[k][r] = static_cast<int>(first);
+      }
+      cross_sums_offset_[k] = cross_sums_displs_[k][rank];
+      sampled_cross_averages[k].assign(cross_sums_counts_[k][rank],0.0);
+    }
+  }
+}
+
+
+std::vector<double> VesBias::computeDistributedCovarianceFromAverages(const unsigned int c_id) const {
+  // the covariance of the owned rows is calculated from the local part of the
+  // sums and then gathered from all ranks
+  size_t ncoeffs = numberOfCoeffs(c_id);
+  size_t offset = cross_sums_offset_[c_id];
+  const std::vector<double>& averages = sampled_averages[c_id];
+  const std::vector<double>& cross_averages = sampled_cross_averages[c_id];
+  std::vector<double> local_covariance(cross_averages.size(),0.0);
+  for(size_t i=owned_coeffs_begin_[c_id]; i<owned_coeffs_end_[c_id]; i++) {
+    for(size_t j=i; j<ncoeffs; j++) {
+      size_t midx = getHessianIndex(i,j,c_id)-offset;
+      local_covariance[midx] = cross_averages[midx] - averages[i]*averages[j];
+    }
+  }
+  std::vector<double> covariance(hessian_pntrs_[c_id]->getSize(),0.0);
+  comm.Allgatherv(local_covariance,covariance,&cross_sums_counts_[c_id][0],&cross_sums_displs_[c_id][0]);
+  return covariance;
 }
 
 
 void VesBias::disableHessian() {
   compute_hessian_=false;
   diagonal_hessian_=true;
+  hessian_buffers_.clear();
+  hessian_buffer_counters_.clear();
   sampled_cross_averages.clear();
   for (unsigned int i=0; i<ncoeffssets_; i++) {
     delete hessian_pntrs_[i];
@@ -666,6 +1293,7 @@ void VesBias::disableHessian() {
     cross_aver_sampled_tmp.assign(hessian_pntrs_[i]->getSize(),0.0);
     sampled_cross_averages.push_back(cross_aver_sampled_tmp);
   }
+  setupCoeffsOwnership();
 }
 
 
@@ -29,9 +29,11 @@
 #include "core/ActionWithValue.h"
 #include "core/ActionWithArguments.h"
 #include "bias/Bias.h"
+#include "tools/Communicator.h"
 
 #include <vector>
 #include <string>
+#include <map>
 #include <cmath>
 
 
@@ -65,9 +67,13 @@ private:
   std::vector<CoeffsVector*> targetdist_averages_pntrs_;
   std::vector<CoeffsVector*> gradient_pntrs_;
   std::vector<CoeffsMatrix*> hessian_pntrs_;
+  std::vector<const CoeffsVector*> coeffs_mask_pntrs_;
+  // sums over the samples, only divided by the number of samples when updating the gradient and Hessian
   std::vector<std::vector<double> > sampled_averages;
   std::vector<std::vector<double> > sampled_cross_averages;
   bool use_multiple_coeffssets_;
+  // increased every time the coefficients are changed
+  unsigned long int coeffs_version_;
   //
   std::vector<std::string> coeffs_fnames;
   //
@@ -75,11 +81,53 @@ private:
   //
   Optimizer* optimizer_pntr_;
   bool optimize_coeffs_;
+  // keyword of the bias that does not allow the coefficients to be optimized
+  std::string static_bias_keyword_;
   //
   bool compute_hessian_;
   bool diagonal_hessian_;
   //
   std::vector<unsigned int> aver_counters;
+  // contiguous block of coefficients owned by each rank when accumulating the
+  // sums, for the full Hessian balanced by the number of elements in the rows
+  std::vector<size_t> owned_coeffs_begin_;
+  std::vector<size_t> owned_coeffs_end_;
+  // only the rows of the full Hessian owned by the rank are stored in sampled_cross_averages,
+  // starting at the packed index cross_sums_offset_, counts and displacements of all ranks
+  bool distributed_hessian_;
+  std::vector<size_t> cross_sums_offset_;
+  std::vector<std::vector<int> > cross_sums_counts_;
+  std::vector<std::vector<int> > cross_sums_displs_;
+  // samples are only taken every averaging_stride_ steps
+  unsigned int averaging_stride_;
+  // samples buffered for a rank-k update of the off-diagonal part of the Hessian,
+  // stored as hessian_buffers_[c_id][b*ncoeffs+i] for sample b
+  unsigned int hessian_buffer_size_;
+  std::vector<std::vector<double> > hessian_buffers_;
+  std::vector<unsigned int> hessian_buffer_counters_;
+  // non-zero entries in each dimension used when accumulating tensor products directly
+  std::vector<std::vector<unsigned int> > tensor_nonzero_;
+  std::vector<unsigned int> tensor_pos_;
+  // non-blocking reduction of the averages over multiple walkers, completed at the next update
+  bool mwalkers_async_;
+  std::vector<std::vector<double> > mwalkers_send_buffers_;
+  std::vector<std::vector<double> > mwalkers_recv_buffers_;
+  std::vector<Communicator::Request> mwalkers_requests_;
+  std::vector<bool> mwalkers_pending_;
+  unsigned int mwalkers_async_updates_;
+  // communicator spanning all ranks of all walkers, used to reduce the averages in a single collective
+  Communicator mwalkers_comm_;
+  bool mwalkers_comm_setup_;
+  bool mwalkers_single_precision_;
+  // walkers run as independent jobs that exchange their sums through files in a shared directory
+  std::string walkers_directory_;
+  std::string walker_id_;
+  // the files hold the running totals of the sums followed by the number of samples,
+  // the totals last read from each walker are kept such that only the difference is added
+  std::vector<unsigned long> walkers_sequence_;
+  std::vector<std::vector<double> > walkers_own_totals_;
+  std::vector<std::map<std::string,unsigned long> > walkers_last_read_;
+  std::vector<std::map<std::string,std::vector<double> > > walkers_last_totals_;
   //
   double kbt_;
   //
@@ -132,10 +180,20 @@ private:
 private:
   void initializeCoeffs(CoeffsVector*);
   std::vector<double> computeCovarianceFromAverages(const unsigned int) const;
-  void multiSimSumAverages(const unsigned int, const double walker_weight=1.0);
+  std::vector<double> computeDistributedCovarianceFromAverages(const unsigned int) const;
+  void setupCoeffsOwnership();
+  bool distributedCrossSums() const {return distributed_hessian_ && !diagonal_hessian_;}
+  void setupWalkersCommunicator();
+  void getSumsPntrs(const unsigned int, std::vector<std::vector<double>*>&, const bool replicated_only=false);
+  template<class T>
+  void reducePackedSums(Communicator&, std::vector<T>&, const bool, std::vector<unsigned int>&);
+  void multiSimSumAveragesAsync(const unsigned int, const double, const double, unsigned int&);
+  void exchangeSumsWithWalkers(const unsigned int);
+  bool readWalkerFile(const std::string&, const std::string&, const unsigned int, std::vector<double>&);
 protected:
   //
   void checkThatTemperatureIsGiven();
+  void setStaticBiasOnly(const std::string& keyword) {static_bias_keyword_=keyword;}
   //
   void addCoeffsSet(const std::vector<std::string>&,const std::vector<unsigned int>&);
   void addCoeffsSet(std::vector<Value*>&,std::vector<BasisFunctions*>&);
@@ -144,6 +202,11 @@ protected:
   std::string getCoeffsSetLabelString(const std::string&, const unsigned int coeffs_id = 0) const;
   void clearCoeffsPntrsVector() {coeffs_pntrs_.clear();}
   void addToSampledAverages(const std::vector<double>&, const unsigned int c_id = 0);
+  void addToSampledAverages(const std::vector<double>&, const std::vector<size_t>&, const unsigned int c_id = 0);
+  // the values are given as the tensor product of the values in each dimension times a scaling factor
+  void addToSampledAverages(const std::vector< std::vector<double> >&, const double, const unsigned int c_id = 0);
+  bool tensorProductAveragesPossible() const {return diagonal_hessian_;}
+  void flushHessianBuffer(const unsigned int c_id = 0);
   void setTargetDistAverages(const std::vector<double>&, const unsigned int coeffs_id = 0);
   void setTargetDistAverages(const CoeffsVector&, const unsigned int coeffs_id= 0);
   void setTargetDistAveragesToZero(const unsigned int coeffs_id= 0);
@@ -168,6 +231,8 @@ public:
   static void useGridBinKeywords(Keywords&);
   static void useGridLimitsKeywords(Keywords&);
   static void useBiasCutoffKeywords(Keywords&);
+  static void useAveragingStrideKeywords(Keywords&);
+  static void useMultipleTimeStepKeywords(Keywords&);
   static void useProjectionArgKeywords(Keywords&);
   static void useReweightFactorKeywords(Keywords&);
   //
@@ -187,6 +252,8 @@ public:
   size_t numberOfCoeffs(const unsigned int coeffs_id = 0) const {return coeffs_pntrs_[coeffs_id]->numberOfCoeffs();}
   size_t totalNumberOfCoeffs() const {return ncoeffs_total_;}
   unsigned int numberOfCoeffsSets() const {return ncoeffssets_;}
+  unsigned long int getCoeffsVersion() const {return coeffs_version_;}
+  void increaseCoeffsVersion() {coeffs_version_++;}
   double getKbT() const {return kbt_;}
   double getBeta() const;
   //
@@ -202,6 +269,9 @@ public:
   bool computeHessian() const {return compute_hessian_;}
   bool diagonalHessian() const {return diagonal_hessian_;}
   //
+  unsigned int getAveragingStride() const {return averaging_stride_;}
+  bool isSamplingStep() const {return getStep()%averaging_stride_==0;}
+  //
   bool optimizeCoeffs() const {return optimize_coeffs_;}
   Optimizer* getOptimizerPntr() const {return optimizer_pntr_;}
   bool useMultipleWalkers() const;
@@ -215,7 +285,19 @@ public:
   virtual void restartTargetDistributions() {};
   //
   void linkOptimizer(Optimizer*);
+  void linkCoeffsMask(const CoeffsVector*, const CoeffsVector*);
+  const CoeffsVector* getCoeffsMaskPntr(const unsigned int coeffs_id = 0) const {return coeffs_mask_pntrs_[coeffs_id];}
   void enableHessian(const bool diagonal_hessian=true);
+  void setHessianBufferSize(const unsigned int);
+  void setDistributedHessian(const bool);
+  unsigned int getHessianBufferSize() const {return hessian_buffer_size_;}
+  void setAsyncMultipleWalkers(const bool);
+  void setMultipleWalkersSinglePrecision(const bool single_precision) {mwalkers_single_precision_=single_precision;}
+  void setWalkersDirectory(const std::string&, const std::string&);
+  bool walkersDirectoryActive() const {return walkers_directory_.size()>0;}
+  bool asyncMultipleWalkers() const {return mwalkers_async_;}
+  // at the first update there are no averages from the walkers yet
+  bool asyncWarmUp() const {return mwalkers_async_ && mwalkers_async_updates_<2;}
   void disableHessian();
   //
   void enableMultipleCoeffsSets() {use_multiple_coeffssets_=true;}
@@ -280,8 +362,9 @@ public:
   double getCurrentBiasMaxValue() const {return bias_current_max_value;}
   double getBiasCutoffSwitchingFunction(const double, double&) const;
   double getBiasCutoffSwitchingFunction(const double) const;
-  void applyBiasCutoff(double&, std::vector<double>&) const;
+  double applyBiasCutoff(double&, std::vector<double>&) const;
   void applyBiasCutoff(double&, std::vector<double>&, std::vector<double>&) const;
+  void applyBiasCutoff(double&, std::vector<double>&, std::vector<double>&, const std::vector<size_t>&) const;
   //
   OFile* getOFile(const std::string& filename, const bool multi_sim_single_file=false, const bool enforce_backup=true);
   //
@@ -367,9 +450,15 @@ double VesBias::getBiasCutoffSwitchingFunction(const double bias) const {
 
 
 inline
-void VesBias::applyBiasCutoff(double& bias, std::vector<double>& forces) const {
-  std::vector<double> dummy(0);
-  applyBiasCutoff(bias,forces,dummy);
+double VesBias::applyBiasCutoff(double& bias, std::vector<double>& forces) const {
+  // returns the factor that the derivatives are multiplied with
+  double deriv_factor_sf=0.0;
+  double value_sf = getBiasCutoffSwitchingFunction(bias,deriv_factor_sf);
+  bias *= value_sf;
+  for(unsigned int i=0; i<forces.size(); i++) {
+    forces[i] *= deriv_factor_sf;
+  }
+  return deriv_factor_sf;
 }
 
 
@@ -388,8 +477,24 @@ void VesBias::applyBiasCutoff(double& bias, std::vector<double>& forces, std::ve
 }
 
 
+inline
+void VesBias::applyBiasCutoff(double& bias, std::vector<double>& forces, std::vector<double>& coeffsderivs_values, const std::vector<size_t>& nonzero_coeffs) const {
+  double deriv_factor_sf=0.0;
+  double value_sf = getBiasCutoffSwitchingFunction(bias,deriv_factor_sf);
+  bias *= value_sf;
+  for(unsigned int i=0; i<forces.size(); i++) {
+    forces[i] *= deriv_factor_sf;
+  }
+  // only the non-zero entries need to be scaled
+  for(size_t a=0; a<nonzero_coeffs.size(); a++) {
+    coeffsderivs_values[nonzero_coeffs[a]] *= deriv_factor_sf;
+  }
+}
+
+
 inline
 std::vector<double> VesBias::computeCovarianceFromAverages(const unsigned int c_id) const {
+  if(distributedCrossSums()) {return computeDistributedCovarianceFromAverages(c_id);}
   size_t ncoeffs = numberOfCoeffs(c_id);
   std::vector<double> covariance(sampled_cross_averages[c_id].size(),0.0);
   // diagonal part
@@ -34,6 +34,8 @@
 #include "core/ActionSet.h"
 #include "core/PlumedMain.h"
 
+#include <cmath>
+
 
 namespace PLMD {
 namespace ves {
@@ -158,6 +160,51 @@ where the parameter \f$\lambda\f$ controls how sharply the switchingfunction goe
 The default value is \f$\lambda=10\f$ but this can be changed by using the
 BIAS_CUTOFF_FERMI_LAMBDA keyword.
 
+For long simulations with a static bias the bias can be tabulated on a grid
+at the beginning of the simulation by using the INTERPOLATION_GRID_BINS
+keyword. The bias and the forces are then obtained by spline interpolation
+such that the cost of each step does not depend on the number of
+coefficients. The interpolation error, estimated at the centers of the grid
+cells, is written to the log file and should be checked when choosing the
+number of bins.
+
+\par Parallel Evaluation
+
+When running with several MPI ranks the coefficients can either be split
+between the ranks, which requires reducing the bias and the forces at every
+step, or the full expansion can be evaluated on each rank without any
+communication. By default (EVALUATION_MODE=AUTO) the latter is used unless
+the number of coefficients is large compared to the number of ranks. The
+crossover between the two can be calibrated with the EVALUATION_CROSSOVER
+keyword, which gives the number of coefficients that can be evaluated in the
+time of one step of the MPI reduction. For large expansions with one, two or
+three arguments the evaluation is furthermore split over OpenMP threads.
+
+For localized basis functions, such as splines or Gaussians, only a few
+basis functions are non-zero for a given value of the arguments. This is
+detected at each step and only the corresponding block of coefficients is
+then used to calculate the bias and the forces and to update the averages
+needed for the optimization of the coefficients.
+
+If many of the coefficients are zero, for example when a large part of them
+is excluded from the optimization using the MASK_FILE keyword of the
+optimizer, the SPARSE_EVALUATION flag can be used to evaluate the expansion
+only over the remaining coefficients. When the coefficients are optimized the
+active coefficients are those that are not masked or that are non-zero, while
+for a static bias they are those whose absolute value is larger than
+SPARSE_THRESHOLD. The sparse evaluation is only used if it is expected to be
+cheaper than the full evaluation, which is noted in the log file.
+
+As consecutive steps are strongly correlated it is often not needed to update
+the averages at every step. With the AVERAGING_STRIDE keyword the samples are
+only taken every given number of steps, while only the bias and the forces
+are calculated in the other steps. For large expansions the bias can also be
+evaluated only every STRIDE steps, the forces are then multiplied by the
+stride such that they are applied as impulses (multiple time step). This
+introduces an integration error that should be checked, e.g. by monitoring
+the energy conservation. The samples are then only taken at the steps where
+the bias is evaluated.
+
 \par Examples
 
 In the following example we run a VES_LINEAR_EXPANSION for one CV using
@@ -287,6 +334,17 @@ private:
   LinearBasisSetExpansion* bias_expansion_pntr_;
   size_t ncoeffs_;
   Value* valueForce2_;
+  // buffers reused in every call to calculate()
+  std::vector<double> cv_values_;
+  std::vector<double> forces_;
+  std::vector<double> coeffsderivs_values_;
+  // the non-zero entries of coeffsderivs_values_ for localized basis functions
+  std::vector<size_t> support_coeffs_;
+  //
+  bool sparse_evaluation_;
+  bool sparse_evaluation_setup_;
+  double sparse_threshold_;
+  void setupSparseEvaluation();
 public:
   explicit VesLinearExpansion(const ActionOptions&);
   ~VesLinearExpansion();
@@ -324,6 +382,8 @@ void VesLinearExpansion::registerKeywords( Keywords& keys ) {
   VesBias::useInitialCoeffsKeywords(keys);
   VesBias::useTargetDistributionKeywords(keys);
   VesBias::useBiasCutoffKeywords(keys);
+  VesBias::useAveragingStrideKeywords(keys);
+  VesBias::useMultipleTimeStepKeywords(keys);
   VesBias::useGridBinKeywords(keys);
   VesBias::useProjectionArgKeywords(keys);
   //
@@ -331,8 +391,15 @@ void VesLinearExpansion::registerKeywords( Keywords& keys ) {
   // Added by Y. Isaac Yang to calculate the reweighting factor
   VesBias::useReweightBinKeywords(keys);
   VesBias::useReweightLimitsKeywords(keys);
+  VesBias::useReweightFactorKeywords(keys);
   //
   keys.add("compulsory","BASIS_FUNCTIONS","the label of the one dimensional basis functions that should be used.");
+  keys.add("optional","INTERPOLATION_GRID_BINS","the number of bins of the grid used to interpolate a static bias. If given, the bias is tabulated once on this grid and obtained by spline interpolation during the simulation. Can only be used if the coefficients are read in using the COEFFS keyword and not optimized.");
+  keys.add("compulsory","EVALUATION_MODE","AUTO","how the expansion is evaluated when running with several MPI ranks: REPLICATED to evaluate all coefficients on each rank, DISTRIBUTED to split them between the ranks, or AUTO to choose based on the number of coefficients and ranks.");
+  keys.add("optional","EVALUATION_CROSSOVER","the number of coefficients that can be evaluated in the time of one step of the MPI reduction, used to choose the evaluation mode when EVALUATION_MODE=AUTO.");
+  keys.addFlag("SPARSE_EVALUATION",false,"evaluate the expansion only over the coefficients that are not masked by the optimizer or that are non-zero.");
+  keys.add("compulsory","SPARSE_THRESHOLD","0.0","for a static bias with SPARSE_EVALUATION, only coefficients with an absolute value larger than this threshold are taken into account.");
+  keys.add("compulsory","GRID_DELTA_TOLERANCE","0.0","the bias and FES grids are updated from the change of the coefficients since the last update if only a few of them changed. Only the coefficients that changed by more than this tolerance are taken into account, the smaller changes are kept until they exceed it.");
   keys.addOutputComponent("force2","default","the instantaneous value of the squared force due to this bias potential.");
 }
 
@@ -341,10 +408,29 @@ VesLinearExpansion::VesLinearExpansion(const ActionOptions&ao):
   nargs_(getNumberOfArguments()),
   basisf_pntrs_(0),
   bias_expansion_pntr_(NULL),
-  valueForce2_(NULL)
+  ncoeffs_(0),
+  valueForce2_(NULL),
+  cv_values_(nargs_,0.0),
+  forces_(nargs_,0.0),
+  coeffsderivs_values_(0),
+  support_coeffs_(0),
+  sparse_evaluation_(false),
+  sparse_evaluation_setup_(false),
+  sparse_threshold_(0.0)
 {
   std::vector<std::string> basisf_labels;
   parseMultipleValues("BASIS_FUNCTIONS",basisf_labels,nargs_);
+  std::string evaluation_mode = "AUTO";
+  parse("EVALUATION_MODE",evaluation_mode);
+  double evaluation_crossover = LinearBasisSetExpansion::getDefaultEvaluationCrossover();
+  parse("EVALUATION_CROSSOVER",evaluation_crossover);
+  std::vector<unsigned int> interpolation_grid_bins;
+  parseMultipleValues("INTERPOLATION_GRID_BINS",interpolation_grid_bins,nargs_);
+  parseFlag("SPARSE_EVALUATION",sparse_evaluation_);
+  parse("SPARSE_THRESHOLD",sparse_threshold_);
+  double grid_delta_tolerance = 0.0;
+  parse("GRID_DELTA_TOLERANCE",grid_delta_tolerance);
+  if(grid_delta_tolerance<0.0) {plumed_merror("Error in keyword GRID_DELTA_TOLERANCE of "+getName()+": should be positive or zero");}
   checkRead();
 
   std::string error_msg = "";
@@ -367,17 +453,47 @@ VesLinearExpansion::VesLinearExpansion(const ActionOptions&ao):
 
   addCoeffsSet(args_pntrs,basisf_pntrs_);
   ncoeffs_ = numberOfCoeffs();
+  coeffsderivs_values_.assign(ncoeffs_,0.0);
   bool coeffs_read = readCoeffsFromFiles();
 
   checkThatTemperatureIsGiven();
   bias_expansion_pntr_ = new LinearBasisSetExpansion(getLabel(),getBeta(),comm,args_pntrs,basisf_pntrs_,getCoeffsPntr());
   bias_expansion_pntr_->linkVesBias(this);
+  bias_expansion_pntr_->setGridDeltaTolerance(grid_delta_tolerance);
+  if(grid_delta_tolerance>0.0) {
+    log.printf("  bias grids updated from the coefficients that changed by more than %f\n",grid_delta_tolerance);
+  }
+  log.printf("  using %s kernels to evaluate the basis set expansion\n",LinearBasisSetExpansion::getKernelsName().c_str());
+  bool replicated_evaluation = false;
+  if(evaluation_mode=="REPLICATED") {
+    replicated_evaluation = true;
+  }
+  else if(evaluation_mode=="DISTRIBUTED") {
+    replicated_evaluation = false;
+  }
+  else if(evaluation_mode=="AUTO") {
+    replicated_evaluation = LinearBasisSetExpansion::replicatedEvaluationPreferred(ncoeffs_,comm.Get_size(),evaluation_crossover);
+  }
+  else {
+    plumed_merror("Error in keyword EVALUATION_MODE of "+getName()+": unknown mode "+evaluation_mode+", the options are AUTO, REPLICATED and DISTRIBUTED");
+  }
+  if(replicated_evaluation) {
+    bias_expansion_pntr_->setSerial();
+    log.printf("  the full expansion is evaluated on each of the %d MPI ranks\n",comm.Get_size());
+  }
+  else {
+    bias_expansion_pntr_->setParallel();
+    log.printf("  the coefficients are split between %d MPI ranks\n",comm.Get_size());
+  }
   bias_expansion_pntr_->setGridBins(this->getGridBins());
   // Added by Y. Isaac Yang to calculate the reweighting factor
   if(isReweightGridActive())
   {
     bias_expansion_pntr_->setReweightGrid(getReweightBins(),getStrRWMax(),getStrRWMin());
   }
+  if(isReweightFactorCalculated()) {
+    bias_expansion_pntr_->enableReweightingFactor();
+  }
   //
 
 
@@ -405,6 +521,25 @@ VesLinearExpansion::VesLinearExpansion(const ActionOptions&ao):
     setupBiasFileOutput();
     writeBiasToFile();
   }
+  //
+  if(interpolation_grid_bins.size()>0) {
+    if(!coeffs_read) {
+      plumed_merror("Error in keyword INTERPOLATION_GRID_BINS of "+getName()+": can only be used for a static bias where the coefficients are read in using the COEFFS keyword");
+    }
+    if(sparse_evaluation_) {
+      plumed_merror("Error in "+getName()+": SPARSE_EVALUATION and INTERPOLATION_GRID_BINS cannot be used at the same time");
+    }
+    setStaticBiasOnly("INTERPOLATION_GRID_BINS");
+    bias_expansion_pntr_->setupBiasInterpolation(interpolation_grid_bins);
+    double max_error = 0.0;
+    double rms_error = 0.0;
+    double max_force_error = 0.0;
+    bias_expansion_pntr_->getBiasInterpolationError(max_error,rms_error,max_force_error);
+    log.printf("  the static bias is obtained by spline interpolation from a grid with %u",interpolation_grid_bins[0]);
+    for(unsigned int k=1; k<nargs_; k++) {log.printf("x%u",interpolation_grid_bins[k]);}
+    log.printf(" bins\n");
+    log.printf("  estimated interpolation error: maximum %e and root mean square %e for the bias, maximum %e for the forces\n",max_error,rms_error,max_force_error);
+  }
 
   addComponent("force2"); componentIsNotPeriodic("force2");
   valueForce2_=getPntrToComponent("force2");
@@ -420,24 +555,61 @@ VesLinearExpansion::~VesLinearExpansion() {
 
 void VesLinearExpansion::calculate() {
 
-  std::vector<double> cv_values(nargs_);
-  std::vector<double> forces(nargs_);
-  std::vector<double> coeffsderivs_values(ncoeffs_);
-
   for(unsigned int k=0; k<nargs_; k++) {
-    cv_values[k]=getArgument(k);
+    cv_values_[k]=getArgument(k);
   }
 
   bool all_inside = true;
-  double bias = bias_expansion_pntr_->getBiasAndForces(cv_values,all_inside,forces,coeffsderivs_values);
-  if(biasCutoffActive()) {
-    applyBiasCutoff(bias,forces,coeffsderivs_values);
-    coeffsderivs_values[0]=1.0;
+  double bias = 0.0;
+  bool interpolated = bias_expansion_pntr_->biasInterpolationActive();
+  if(interpolated) {
+    bias = bias_expansion_pntr_->getBiasAndForcesFromGrid(cv_values_,all_inside,forces_);
+  }
+  else {
+    // the optimizer, and thus the mask, is only linked after the bias is setup
+    if(sparse_evaluation_ && !sparse_evaluation_setup_) {
+      setupSparseEvaluation();
+    }
+    if(!isSamplingStep()) {
+      // only the bias and forces are needed on the steps where no samples are taken
+      bias = bias_expansion_pntr_->getBiasAndForcesWithoutBasisSetValues(cv_values_,all_inside,forces_);
+      if(biasCutoffActive()) {applyBiasCutoff(bias,forces_);}
+    }
+    else if(!bias_expansion_pntr_->sparseEvaluationActive() && tensorProductAveragesPossible()) {
+      // the basis set values are not stored but accumulated directly from the
+      // values of the basis functions, with the scaling from the bias cutoff
+      bias = bias_expansion_pntr_->getBiasAndForcesWithoutBasisSetValues(cv_values_,all_inside,forces_);
+      double cutoff_factor = 1.0;
+      if(biasCutoffActive()) {cutoff_factor = applyBiasCutoff(bias,forces_);}
+      if(all_inside) {addToSampledAverages(bias_expansion_pntr_->getBasisFunctionValuesInWorkspace(),cutoff_factor);}
+    }
+    else {
+      // list of the non-zero entries of coeffsderivs_values_, NULL if all are needed
+      const std::vector<size_t>* nonzero_coeffs = NULL;
+      if(bias_expansion_pntr_->sparseEvaluationActive()) {
+        bias = bias_expansion_pntr_->getBiasAndForces(cv_values_,all_inside,forces_,coeffsderivs_values_);
+        nonzero_coeffs = &bias_expansion_pntr_->getActiveCoeffs();
+      }
+      else {
+        bias = bias_expansion_pntr_->getBiasAndForces(cv_values_,all_inside,forces_,coeffsderivs_values_,support_coeffs_);
+        if(support_coeffs_.size()>0) {nonzero_coeffs = &support_coeffs_;}
+      }
+      if(biasCutoffActive()) {
+        if(nonzero_coeffs!=NULL) {applyBiasCutoff(bias,forces_,coeffsderivs_values_,*nonzero_coeffs);}
+        else {applyBiasCutoff(bias,forces_,coeffsderivs_values_);}
+        coeffsderivs_values_[0]=1.0;
+      }
+      // the averages are only needed for optimizing the coefficients
+      if(all_inside) {
+        if(nonzero_coeffs!=NULL) {addToSampledAverages(coeffsderivs_values_,*nonzero_coeffs);}
+        else {addToSampledAverages(coeffsderivs_values_);}
+      }
+    }
   }
   double totalForce2 = 0.0;
   for(unsigned int k=0; k<nargs_; k++) {
-    setOutputForce(k,forces[k]);
-    totalForce2 += forces[k]*forces[k];
+    setOutputForce(k,forces_[k]);
+    totalForce2 += forces_[k]*forces_[k];
   }
 
   setBias(bias);
@@ -445,9 +617,38 @@ void VesLinearExpansion::calculate() {
   // Added By Y. Isaac Yang to calculte the reweighting factor
   setValueReweightFactor(getReweightFactor());
   setValueReweightBias(bias - getReweightFactor());
-  //
-  if(all_inside) {
-    addToSampledAverages(coeffsderivs_values);
+}
+
+
+void VesLinearExpansion::setupSparseEvaluation() {
+  sparse_evaluation_setup_ = true;
+  std::vector<size_t> active_coeffs;
+  // the constant term is always needed for the bias cutoff
+  active_coeffs.push_back(0);
+  if(optimizeCoeffs()) {
+    const CoeffsVector* mask_pntr = getCoeffsMaskPntr();
+    if(mask_pntr==NULL) {
+      log.printf("  %s: no mask given in the optimizer, the sparse evaluation is not used\n",getLabel().c_str());
+      return;
+    }
+    for(size_t i=1; i<ncoeffs_; i++) {
+      if(mask_pntr->getValue(i)!=0.0 || getCoeffsPntr()->getValue(i)!=0.0) {active_coeffs.push_back(i);}
+    }
+  }
+  else {
+    for(size_t i=1; i<ncoeffs_; i++) {
+      if(std::fabs(getCoeffsPntr()->getValue(i))>sparse_threshold_) {active_coeffs.push_back(i);}
+    }
+  }
+  // each active coefficient costs about nargs multiplications more than in
+  // the full evaluation where the products are shared between coefficients
+  if(active_coeffs.size()*nargs_<ncoeffs_) {
+    bias_expansion_pntr_->setupSparseEvaluation(active_coeffs);
+    std::fill(coeffsderivs_values_.begin(),coeffsderivs_values_.end(),0.0);
+    log.printf("  %s: using sparse evaluation over %zu of the %zu coefficients\n",getLabel().c_str(),active_coeffs.size(),ncoeffs_);
+  }
+  else {
+    log.printf("  %s: %zu of the %zu coefficients are active, the sparse evaluation is not used\n",getLabel().c_str(),active_coeffs.size(),ncoeffs_);
   }
 }
 
@@ -477,12 +678,15 @@ void VesLinearExpansion::setupBiasFileOutput() {
 
 
 void VesLinearExpansion::writeBiasToFile() {
+  // the bias without cutoff is updated first as all the bias grids are then obtained in the same sweep
+  if(biasCutoffActive()) {
+    bias_expansion_pntr_->updateBiasWithoutCutoffGrid();
+  }
   bias_expansion_pntr_->updateBiasGrid();
   OFile* ofile_pntr = getOFile(getCurrentBiasOutputFilename(),useMultipleWalkers());
   bias_expansion_pntr_->writeBiasGridToFile(*ofile_pntr);
   ofile_pntr->close(); delete ofile_pntr;
   if(biasCutoffActive()) {
-    bias_expansion_pntr_->updateBiasWithoutCutoffGrid();
     OFile* ofile_pntr2 = getOFile(getCurrentBiasOutputFilename("without-cutoff"),useMultipleWalkers());
     bias_expansion_pntr_->writeBiasWithoutCutoffGridToFile(*ofile_pntr2);
     ofile_pntr2->close(); delete ofile_pntr2;
@@ -502,7 +706,7 @@ void VesLinearExpansion::writeBiasToFile() {
 
 
 void VesLinearExpansion::resetBiasFileOutput() {
-  bias_expansion_pntr_->resetStepOfLastBiasGridUpdate();
+  bias_expansion_pntr_->invalidateBiasGrid();
 }
 
 
@@ -520,7 +724,7 @@ void VesLinearExpansion::writeFesToFile() {
 
 
 void VesLinearExpansion::resetFesFileOutput() {
-  bias_expansion_pntr_->resetStepOfLastFesGridUpdate();
+  bias_expansion_pntr_->invalidateFesGrid();
 }
 
 